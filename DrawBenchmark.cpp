@@ -0,0 +1,371 @@
+#include <math.h>
+#include <string.h>
+#include <QElapsedTimer>
+#include <QDebug>
+#include "DrawBenchmark.h"
+
+static const int WarmupFrames = 3;
+
+DrawBenchmark::DrawBenchmark(QOpenGLFunctions_3_3_Core *gl) :
+    G(gl), _offset_source_i(-1), _offset_i(-1),
+    _fbo(0), _colorRb(0),
+    _arraysVao(0), _elementsVao(0), _arraysVbo(0), _elementsVbo(0), _ibo(0),
+    _offsetVbo(0), _ringVbo(0), _ubo(0), _uboAlign(256),
+    _indicesPerObject(0), _verticesPerObject(0),
+    _timeQuery(0),
+    _gpuCharge(MemoryStats::GpuBuffers)
+{
+    for (int i = 0; i < RingSections; ++i)
+        _ringFence[i] = 0;
+}
+
+DrawBenchmark::~DrawBenchmark()
+{
+    for (int i = 0; i < RingSections; ++i)
+        if (_ringFence[i])
+            G->glDeleteSync(_ringFence[i]);
+
+    GLuint buffers[] = { _arraysVbo, _elementsVbo, _ibo, _offsetVbo, _ringVbo, _ubo };
+    G->glDeleteBuffers(sizeof(buffers) / sizeof(buffers[0]), buffers);
+    GLuint vaos[] = { _arraysVao, _elementsVao };
+    G->glDeleteVertexArrays(2, vaos);
+    G->glDeleteFramebuffers(1, &_fbo);
+    G->glDeleteRenderbuffers(1, &_colorRb);
+    G->glDeleteQueries(1, &_timeQuery);
+    _gpuCharge.set(0);
+}
+
+bool DrawBenchmark::initialize(const Config &config, QString &log)
+{
+    _config = config;
+
+    if (!_program.addShaderFromSourceFile(QOpenGLShader::Vertex, "Shaders/VertexTest.txt"))
+        log += "VERTEX SHADER LOG:\n" + _program.log() + "\n";
+    if (!_program.addShaderFromSourceFile(QOpenGLShader::Fragment, "Shaders/FragmentTest.txt"))
+        log += "FRAGMENT SHADER LOG:\n" + _program.log() + "\n";
+    if (!_program.link()) {
+        log += "LINK LOG:\n" + _program.log() + "\n";
+        return false;
+    }
+
+    const GLuint p = _program.programId();
+    _offset_source_i = G->glGetUniformLocation(p, "offset_source");
+    _offset_i = G->glGetUniformLocation(p, "offset");
+    G->glUniformBlockBinding(p, G->glGetUniformBlockIndex(p, "Offset"), 0);
+    G->glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &_uboAlign);
+    _uboAlign = qMax(_uboAlign, 16);
+
+    G->glGenFramebuffers(1, &_fbo);
+    G->glGenRenderbuffers(1, &_colorRb);
+    G->glBindRenderbuffer(GL_RENDERBUFFER, _colorRb);
+    G->glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, _config.width, _config.height);
+    G->glBindFramebuffer(GL_FRAMEBUFFER, _fbo);
+    G->glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, _colorRb);
+    if (G->glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        log += "BENCHMARK FRAMEBUFFER INCOMPLETE\n";
+        return false;
+    }
+
+    G->glGenQueries(1, &_timeQuery);
+
+    setupGeometry();
+    setupOffsets();
+    return true;
+}
+
+void DrawBenchmark::createBuffer(GLuint &buffer, GLenum target, qint64 bytes, const void *data, GLenum usage)
+{
+    G->glGenBuffers(1, &buffer);
+    G->glBindBuffer(target, buffer);
+    G->glBufferData(target, bytes, data, usage);
+    _gpuCharge.set(_gpuCharge.bytes() + bytes);
+}
+
+// Objects are fans of trianglesPerObject triangles, one per cell of a square grid covering the viewport.  The
+// non-indexed copy has 3 vertices per triangle; the indexed one shares the center and the rim vertices.
+void DrawBenchmark::setupGeometry()
+{
+    const int n = _config.objectCount, t = _config.trianglesPerObject;
+    const int side = (int)ceil(sqrt((double)n));
+    const float cell = 2.0f / side, radius = 0.45f * cell;
+
+    std::vector<float> arrays, elements;
+    std::vector<GLuint> indices;
+    arrays.reserve((size_t)n * t * 6);
+    elements.reserve((size_t)n * (t + 1) * 2);
+    indices.reserve((size_t)n * t * 3);
+
+    _verticesPerObject = 3 * t;
+    _indicesPerObject = 3 * t;
+
+    for (int i = 0; i < n; ++i)
+    {
+        const float cx = -1 + (i % side + 0.5f) * cell, cy = -1 + (i / side + 0.5f) * cell;
+        const GLuint base = (GLuint)(elements.size() / 2);
+
+        elements.push_back(cx); elements.push_back(cy);
+        for (int k = 0; k < t; ++k) {
+            const float a = 2 * 3.14159265f * k / t;
+            elements.push_back(cx + radius * cosf(a));
+            elements.push_back(cy + radius * sinf(a));
+        }
+
+        for (int k = 0; k < t; ++k) {
+            const GLuint k0 = base + 1 + k, k1 = base + 1 + (k + 1) % t;
+            indices.push_back(base); indices.push_back(k0); indices.push_back(k1);
+
+            const GLuint tri[3] = { base, k0, k1 };
+            for (int j = 0; j < 3; ++j) {
+                arrays.push_back(elements[2*tri[j]]);
+                arrays.push_back(elements[2*tri[j]+1]);
+            }
+        }
+    }
+
+    G->glGenVertexArrays(1, &_arraysVao);
+    G->glBindVertexArray(_arraysVao);
+    createBuffer(_arraysVbo, GL_ARRAY_BUFFER, arrays.size() * sizeof(float), &arrays[0], GL_STATIC_DRAW);
+    G->glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    G->glEnableVertexAttribArray(0);
+
+    G->glGenVertexArrays(1, &_elementsVao);
+    G->glBindVertexArray(_elementsVao);
+    createBuffer(_elementsVbo, GL_ARRAY_BUFFER, elements.size() * sizeof(float), &elements[0], GL_STATIC_DRAW);
+    G->glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    G->glEnableVertexAttribArray(0);
+    createBuffer(_ibo, GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), &indices[0], GL_STATIC_DRAW);
+    G->glBindVertexArray(0);
+
+    _multiCounts.assign(n, _indicesPerObject);
+    _multiOffsets.resize(n);
+    for (int i = 0; i < n; ++i)
+        _multiOffsets[i] = (const void*)((size_t)i * _indicesPerObject * sizeof(GLuint));
+}
+
+// Per-instance offsets (instanced paths), the mapped ring, and one aligned uniform block slot per object.
+void DrawBenchmark::setupOffsets()
+{
+    const qint64 bytes = (qint64)_config.objectCount * 4 * sizeof(float);
+    std::vector<float> offsets(_config.objectCount * 4);
+    writeOffsets(0, &offsets[0]);
+
+    createBuffer(_offsetVbo, GL_ARRAY_BUFFER, bytes, &offsets[0], GL_STREAM_DRAW);
+    createBuffer(_ringVbo, GL_ARRAY_BUFFER, RingSections * bytes, 0, GL_STREAM_DRAW);
+    createBuffer(_ubo, GL_UNIFORM_BUFFER, (qint64)_config.objectCount * _uboAlign, 0, GL_STREAM_DRAW);
+    G->glBindBuffer(GL_ARRAY_BUFFER, 0);
+    G->glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+// Instance i draws object 0 moved onto object i's cell, plus a per-frame wobble so that updates aren't no-ops.
+void DrawBenchmark::writeOffsets(int frame, float *out) const
+{
+    const int n = _config.objectCount;
+    const int side = (int)ceil(sqrt((double)n));
+    const float cell = 2.0f / side, wobble = 1e-3f * sinf(0.1f * frame);
+
+    for (int i = 0; i < n; ++i) {
+        *out++ = (i % side) * cell + wobble;
+        *out++ = (i / side) * cell;
+        *out++ = 0;
+        *out++ = 0;
+    }
+}
+
+void DrawBenchmark::useProgram(OffsetSource source)
+{
+    _program.bind();
+    G->glUniform1i(_offset_source_i, source);
+    G->glUniform4f(_offset_i, 0, 0, 0, 0);
+}
+
+DrawBenchmark::Result DrawBenchmark::run(const char *name, int drawCalls, FrameFunction frameFunction)
+{
+    QElapsedTimer timer;
+    qint64 cpuNs = 0, wallNs;
+    GLuint64 gpuNs = 0;
+
+    G->glBindFramebuffer(GL_FRAMEBUFFER, _fbo);
+    G->glViewport(0, 0, _config.width, _config.height);
+    G->glClearColor(0, 0, 0, 1);
+
+    // The first use of a path may make the driver compile or allocate something.
+    for (int f = -WarmupFrames; f < 0; ++f) {
+        G->glClear(GL_COLOR_BUFFER_BIT);
+        (this->*frameFunction)(f);
+    }
+    G->glFinish();
+
+    timer.start();
+    G->glBeginQuery(GL_TIME_ELAPSED, _timeQuery);
+    for (int f = 0; f < _config.frames; ++f) {
+        const qint64 t0 = timer.nsecsElapsed();
+        G->glClear(GL_COLOR_BUFFER_BIT);
+        (this->*frameFunction)(f);
+        cpuNs += timer.nsecsElapsed() - t0;
+    }
+    G->glEndQuery(GL_TIME_ELAPSED);
+    G->glFinish();
+    wallNs = timer.nsecsElapsed();
+    G->glGetQueryObjectui64v(_timeQuery, GL_QUERY_RESULT, &gpuNs);
+
+    G->glBindVertexArray(0);
+    G->glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    Result r;
+    r.name = name;
+    r.drawCalls = drawCalls;
+    r.cpuMs = cpuNs / 1e6 / _config.frames;
+    r.gpuMs = gpuNs / 1e6 / _config.frames;
+    r.wallMs = wallNs / 1e6 / _config.frames;
+    return r;
+}
+
+std::vector<DrawBenchmark::Result> DrawBenchmark::runAll()
+{
+    const int n = _config.objectCount;
+    std::vector<Result> results;
+
+    results.push_back(run("glDrawArrays per object", n, &DrawBenchmark::drawArraysPerObject));
+    results.push_back(run("glDrawElements per object", n, &DrawBenchmark::drawElementsPerObject));
+    results.push_back(run("glMultiDrawElements", 1, &DrawBenchmark::multiDrawElements));
+    results.push_back(run("glDrawElementsInstanced", 1, &DrawBenchmark::drawElementsInstanced));
+    results.push_back(run("glUniform4f + glDrawElements", n, &DrawBenchmark::uniformPerDraw));
+    results.push_back(run("UBO range + glDrawElements", n, &DrawBenchmark::uniformBlockPerDraw));
+    results.push_back(run("instanced, glBufferData offsets", 1, &DrawBenchmark::updateBufferData));
+    results.push_back(run("instanced, glBufferSubData offsets", 1, &DrawBenchmark::updateSubData));
+    results.push_back(run("instanced, mapped ring offsets", 1, &DrawBenchmark::updateMappedRing));
+    return results;
+}
+
+void DrawBenchmark::drawArraysPerObject(int)
+{
+    useProgram(UniformOffset);
+    G->glBindVertexArray(_arraysVao);
+    for (int i = 0; i < _config.objectCount; ++i)
+        G->glDrawArrays(GL_TRIANGLES, i * _verticesPerObject, _verticesPerObject);
+}
+
+void DrawBenchmark::drawElementsPerObject(int)
+{
+    useProgram(UniformOffset);
+    G->glBindVertexArray(_elementsVao);
+    for (int i = 0; i < _config.objectCount; ++i)
+        G->glDrawElements(GL_TRIANGLES, _indicesPerObject, GL_UNSIGNED_INT, _multiOffsets[i]);
+}
+
+void DrawBenchmark::multiDrawElements(int)
+{
+    useProgram(UniformOffset);
+    G->glBindVertexArray(_elementsVao);
+    G->glMultiDrawElements(GL_TRIANGLES, &_multiCounts[0], GL_UNSIGNED_INT, &_multiOffsets[0],
+        _config.objectCount);
+}
+
+void DrawBenchmark::drawElementsInstanced(int)
+{
+    useProgram(AttributeOffset);
+    G->glBindVertexArray(_elementsVao);
+    G->glBindBuffer(GL_ARRAY_BUFFER, _offsetVbo);
+    G->glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    G->glVertexAttribDivisor(1, 1);
+    G->glEnableVertexAttribArray(1);
+    G->glDrawElementsInstanced(GL_TRIANGLES, _indicesPerObject, GL_UNSIGNED_INT, 0, _config.objectCount);
+    G->glDisableVertexAttribArray(1);
+}
+
+void DrawBenchmark::uniformPerDraw(int frame)
+{
+    const float wobble = 1e-3f * sinf(0.1f * frame);
+
+    useProgram(UniformOffset);
+    G->glBindVertexArray(_elementsVao);
+    for (int i = 0; i < _config.objectCount; ++i) {
+        G->glUniform4f(_offset_i, wobble, 0, 0, 0);
+        G->glDrawElements(GL_TRIANGLES, _indicesPerObject, GL_UNSIGNED_INT, _multiOffsets[i]);
+    }
+}
+
+// One upload of all blocks per frame, then a range bind per draw.
+void DrawBenchmark::uniformBlockPerDraw(int frame)
+{
+    const int n = _config.objectCount;
+    const float wobble = 1e-3f * sinf(0.1f * frame);
+    std::vector<char> blocks((size_t)n * _uboAlign, 0);
+    for (int i = 0; i < n; ++i)
+        memcpy(&blocks[(size_t)i * _uboAlign], &wobble, sizeof(float));
+
+    useProgram(BlockOffset);
+    G->glBindBuffer(GL_UNIFORM_BUFFER, _ubo);
+    G->glBufferSubData(GL_UNIFORM_BUFFER, 0, blocks.size(), &blocks[0]);
+    G->glBindVertexArray(_elementsVao);
+    for (int i = 0; i < n; ++i) {
+        G->glBindBufferRange(GL_UNIFORM_BUFFER, 0, _ubo, (GLintptr)i * _uboAlign, 4 * sizeof(float));
+        G->glDrawElements(GL_TRIANGLES, _indicesPerObject, GL_UNSIGNED_INT, _multiOffsets[i]);
+    }
+}
+
+// Rewrite all per-instance offsets every frame, then draw them with one instanced call.
+void DrawBenchmark::updateAndDrawInstanced(int frame, UpdateStrategy strategy)
+{
+    const qint64 bytes = (qint64)_config.objectCount * 4 * sizeof(float);
+    GLuint buffer = _offsetVbo;
+    GLintptr offset = 0;
+
+    useProgram(AttributeOffset);
+    G->glBindVertexArray(_elementsVao);
+
+    if (strategy == UpdateMappedRing)
+    {
+        // Write into a section the GPU is done with, without the driver synchronizing or copying for us.
+        const int s = (frame + RingSections) % RingSections;
+        if (_ringFence[s]) {
+            G->glClientWaitSync(_ringFence[s], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+            G->glDeleteSync(_ringFence[s]);
+            _ringFence[s] = 0;
+        }
+
+        buffer = _ringVbo;
+        offset = s * bytes;
+        G->glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        void *p = G->glMapBufferRange(GL_ARRAY_BUFFER, offset, bytes,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        writeOffsets(frame, (float*)p);
+        G->glUnmapBuffer(GL_ARRAY_BUFFER);
+    }
+    else
+    {
+        std::vector<float> offsets(_config.objectCount * 4);
+        writeOffsets(frame, &offsets[0]);
+        G->glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        if (strategy == UpdateBufferData)
+            G->glBufferData(GL_ARRAY_BUFFER, bytes, &offsets[0], GL_STREAM_DRAW);
+        else
+            G->glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, &offsets[0]);
+    }
+
+    G->glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 0, (void*)offset);
+    G->glVertexAttribDivisor(1, 1);
+    G->glEnableVertexAttribArray(1);
+    G->glDrawElementsInstanced(GL_TRIANGLES, _indicesPerObject, GL_UNSIGNED_INT, 0, _config.objectCount);
+    G->glDisableVertexAttribArray(1);
+
+    if (strategy == UpdateMappedRing) {
+        const int s = (frame + RingSections) % RingSections;
+        _ringFence[s] = G->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+}
+
+QString DrawBenchmark::table(const Config &config, const std::vector<Result> &results)
+{
+    QString t = QString("%1 objects x %2 triangles = %3 triangles/frame, %4 frames, %5x%6\n")
+        .arg(config.objectCount).arg(config.trianglesPerObject)
+        .arg((qint64)config.objectCount * config.trianglesPerObject)
+        .arg(config.frames).arg(config.width).arg(config.height);
+
+    t += QString("%1 %2 %3 %4 %5\n").arg("path", -36).arg("draws", 7).arg("cpu ms", 9).arg("gpu ms", 9)
+        .arg("wall ms", 9);
+    for (const auto &r : results)
+        t += QString("%1 %2 %3 %4 %5\n").arg(r.name, -36).arg(r.drawCalls, 7)
+            .arg(r.cpuMs, 9, 'f', 3).arg(r.gpuMs, 9, 'f', 3).arg(r.wallMs, 9, 'f', 3);
+    return t;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+#include <QString>
+#include <QOpenGLFunctions_3_3_Core>
+#include <QOpenGLShaderProgram>
+#include "MemoryStats.h"
+
+// GL submission microbenchmark.  Draws objectCount small triangle fans of trianglesPerObject triangles each
+// into its own framebuffer through different submission paths, and measures CPU submission time and GPU time
+// per frame.  Needs a current 3.3 core context for its whole lifetime, but no window.
+class DrawBenchmark
+{
+public:
+    struct Config
+    {
+        int objectCount, trianglesPerObject, frames;
+        int width, height;
+
+        Config() : objectCount(1000), trianglesPerObject(64), frames(100), width(512), height(512) { }
+    };
+
+    struct Result
+    {
+        QString name;
+        int drawCalls;          // per frame
+        double cpuMs;           // submission only, per frame
+        double gpuMs;           // GL_TIME_ELAPSED, per frame
+        double wallMs;          // submission through glFinish, per frame
+    };
+
+    explicit DrawBenchmark(QOpenGLFunctions_3_3_Core *gl);
+    ~DrawBenchmark();
+
+    bool initialize(const Config &config, QString &log);
+    std::vector<Result> runAll();
+    GLuint framebuffer() const { return _fbo; }
+
+    static QString table(const Config &config, const std::vector<Result> &results);
+
+private:
+    enum OffsetSource { UniformOffset, BlockOffset, AttributeOffset };
+    enum UpdateStrategy { UpdateBufferData, UpdateSubData, UpdateMappedRing };
+
+    typedef void (DrawBenchmark::*FrameFunction)(int frame);
+    Result run(const char *name, int drawCalls, FrameFunction frameFunction);
+
+    void drawArraysPerObject(int frame);
+    void drawElementsPerObject(int frame);
+    void multiDrawElements(int frame);
+    void drawElementsInstanced(int frame);
+    void uniformPerDraw(int frame);
+    void uniformBlockPerDraw(int frame);
+    void updateBufferData(int frame) { updateAndDrawInstanced(frame, UpdateBufferData); }
+    void updateSubData(int frame) { updateAndDrawInstanced(frame, UpdateSubData); }
+    void updateMappedRing(int frame) { updateAndDrawInstanced(frame, UpdateMappedRing); }
+    void updateAndDrawInstanced(int frame, UpdateStrategy strategy);
+
+    void setupGeometry();
+    void setupOffsets();
+    void writeOffsets(int frame, float *out) const;
+    void useProgram(OffsetSource source);
+    void createBuffer(GLuint &buffer, GLenum target, qint64 bytes, const void *data, GLenum usage);
+
+    QOpenGLFunctions_3_3_Core *G;
+    Config _config;
+    QOpenGLShaderProgram _program;
+    GLint _offset_source_i, _offset_i;
+
+    GLuint _fbo, _colorRb;
+    GLuint _arraysVao, _elementsVao, _arraysVbo, _elementsVbo, _ibo;
+    GLuint _offsetVbo, _ringVbo, _ubo;
+    GLint _uboAlign;
+    int _indicesPerObject, _verticesPerObject;
+    std::vector<GLsizei> _multiCounts;
+    std::vector<const void*> _multiOffsets;
+
+    // Mapped ring: RingSections copies of the per-instance offsets, each fenced after use.
+    static const int RingSections = 3;
+    GLsync _ringFence[RingSections];
+
+    GLuint _timeQuery;
+    MemoryCharge _gpuCharge;
+};
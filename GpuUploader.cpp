@@ -0,0 +1,155 @@
+#include <QOpenGLContext>
+#include <QOffscreenSurface>
+#include <QCoreApplication>
+#include <QDebug>
+#include "GpuUploader.h"
+#include "MemoryStats.h"
+
+GpuUploader::GpuUploader(QOpenGLContext *shareContext, QObject *parent) :
+    QThread(parent), G(0), _stopping(false)
+{
+    _surface = new QOffscreenSurface;
+    _surface->setFormat(shareContext->format());
+    _surface->create();
+
+    _context = new QOpenGLContext;
+    _context->setFormat(shareContext->format());
+    _context->setShareContext(shareContext);
+    if (!_context->create())
+        qDebug() << "UPLOADER: FAILED TO CREATE SHARED CONTEXT";
+    _context->moveToThread(this);
+}
+
+GpuUploader::~GpuUploader()
+{
+    stop();
+    delete _context;
+    delete _surface;
+}
+
+// Buffers are shared with (and counted by) their producer; only the image is a copy of its own.
+qint64 GpuUploader::stagingBytes(const Request &request)
+{
+    return request.image.byteCount();
+}
+
+void GpuUploader::submit(Request request)
+{
+    MemoryStats::add(MemoryStats::UploadStaging, stagingBytes(request));
+    QMutexLocker lock(&_mutex);
+    _requests.push_back(std::move(request));
+    _wake.wakeOne();
+}
+
+std::vector<GpuUploader::Result> GpuUploader::takeFinished()
+{
+    QMutexLocker lock(&_mutex);
+    std::vector<Result> finished;
+    finished.swap(_finished);
+    return finished;
+}
+
+// Pending requests are dropped; finished results are left for takeFinished() so the owner can delete them.
+void GpuUploader::stop()
+{
+    {
+        QMutexLocker lock(&_mutex);
+        _stopping = true;
+        for (const auto &r : _requests)
+            MemoryStats::add(MemoryStats::UploadStaging, -stagingBytes(r));
+        _requests.clear();
+        _wake.wakeOne();
+    }
+    wait();
+}
+
+void GpuUploader::run()
+{
+    if (!_context->makeCurrent(_surface)) {
+        qDebug() << "UPLOADER: FAILED TO MAKE CONTEXT CURRENT";
+        return;
+    }
+
+    G = _context->versionFunctions<QOpenGLFunctions_3_3_Core>();
+    G->initializeOpenGLFunctions();
+
+    for (;;)
+    {
+        Request request;
+
+        {
+            QMutexLocker lock(&_mutex);
+            while (_requests.empty() && !_stopping)
+                _wake.wait(&_mutex);
+            if (_stopping)
+                break;
+            request = std::move(_requests.front());
+            _requests.erase(_requests.begin());
+
+            bool superseded = false;
+            for (const auto &r : _requests)
+                superseded = superseded || r.kind == request.kind;
+            if (superseded) {
+                MemoryStats::add(MemoryStats::UploadStaging, -stagingBytes(request));
+                continue;
+            }
+        }
+
+        Result result = upload(request);
+        MemoryStats::add(MemoryStats::UploadStaging, -stagingBytes(request));
+        request.buffers.clear();            // so that the producer can write to them again without a copy
+
+        {
+            QMutexLocker lock(&_mutex);
+            _finished.push_back(result);
+        }
+        emit uploadFinished();
+    }
+
+    _context->doneCurrent();
+    _context->moveToThread(QCoreApplication::instance()->thread());
+}
+
+GpuUploader::Result GpuUploader::upload(Request &request)
+{
+    Result result;
+    result.kind = request.kind;
+    result.sequence = request.sequence;
+    result.texture = 0;
+    result.bufferBytes = result.textureBytes = 0;
+
+    if (!request.buffers.empty()) {
+        result.buffers.resize(request.buffers.size());
+        G->glGenBuffers((GLsizei)result.buffers.size(), &result.buffers[0]);
+        for (size_t i = 0; i < result.buffers.size(); ++i) {
+            const Buffer &data = request.buffers[i];
+            G->glBindBuffer(GL_ARRAY_BUFFER, result.buffers[i]);
+            G->glBufferData(GL_ARRAY_BUFFER, data.size, data.data, GL_STATIC_DRAW);
+            result.bufferBytes += data.size;
+        }
+        G->glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    if (!request.image.isNull()) {
+        const QImage &img = request.image;
+        G->glGenTextures(1, &result.texture);
+        G->glBindTexture(GL_TEXTURE_2D, result.texture);
+        G->glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        G->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        G->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        // GRRR, img.format() is RGB32 with alpha forced to 0xFF
+        G->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, img.width(), img.height(), 0, GL_RGBA, GL_UNSIGNED_BYTE,
+            img.constBits());
+        G->glBindTexture(GL_TEXTURE_2D, 0);
+        result.textureBytes = (qint64)img.width() * img.height() * 4;    // RGB8 is padded to 4 bytes in practice
+    }
+
+    MemoryStats::add(MemoryStats::GpuBuffers, result.bufferBytes);
+    MemoryStats::add(MemoryStats::GpuTextures, result.textureBytes);
+
+    // The flush makes sure the fence (and the commands before it) actually reach the GPU; otherwise the
+    // consumer could wait forever on a fence that only exists in this context's command queue.
+    result.fence = G->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    G->glFlush();
+    return result;
+}
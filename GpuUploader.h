@@ -0,0 +1,81 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QImage>
+#include <QOpenGLFunctions_3_3_Core>
+
+QT_FORWARD_DECLARE_CLASS(QOpenGLContext)
+QT_FORWARD_DECLARE_CLASS(QOffscreenSurface)
+
+// Creates and fills GL buffers and textures on its own thread, in a context shared with the one passed to the
+// constructor.  Every finished upload carries a fence; the consumer must not bind the objects before the fence
+// has signalled in its own context, and becomes the owner of the objects and the fence.
+class GpuUploader : public QThread
+{
+    Q_OBJECT
+
+public:
+    // Bytes to upload and the object that keeps them alive until then; shared with the producer, not copied.
+    struct Buffer
+    {
+        std::shared_ptr<const void> owner;
+        const void *data;
+        qint64 size;
+    };
+
+    template<typename T>
+    static Buffer share(const std::shared_ptr<const std::vector<T>> &v)
+    {
+        Buffer b = { v, v->data(), (qint64)(v->size() * sizeof(T)) };
+        return b;
+    }
+
+    // A queued request is dropped unuploaded if a later one of the same kind is queued behind it.
+    struct Request
+    {
+        int kind, sequence;                 // otherwise opaque to the uploader; returned in the result
+        std::vector<Buffer> buffers;        // each becomes one GL_ARRAY_BUFFER
+        QImage image;                       // becomes a GL_TEXTURE_2D if not null
+    };
+
+    struct Result
+    {
+        int kind, sequence;
+        std::vector<GLuint> buffers;
+        GLuint texture;
+        GLsync fence;
+        qint64 bufferBytes, textureBytes;   // reported to MemoryStats; whoever deletes the objects releases them
+    };
+
+    // Must be called from the GUI thread while shareContext exists.
+    GpuUploader(QOpenGLContext *shareContext, QObject *parent = 0);
+    ~GpuUploader();
+
+    void submit(Request request);
+    std::vector<Result> takeFinished();
+    void stop();
+
+signals:
+    void uploadFinished();
+
+protected:
+    void run() override;
+
+private:
+    Result upload(Request &request);
+    static qint64 stagingBytes(const Request &request);
+
+    QOpenGLContext *_context;
+    QOffscreenSurface *_surface;
+    QOpenGLFunctions_3_3_Core *G;
+
+    QMutex _mutex;
+    QWaitCondition _wake;
+    std::vector<Request> _requests;
+    std::vector<Result> _finished;
+    bool _stopping;
+};
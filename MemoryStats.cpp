@@ -0,0 +1,80 @@
+#include <atomic>
+#include "MemoryStats.h"
+
+static std::atomic<qint64> s_current[MemoryStats::CategoryCount];
+static std::atomic<qint64> s_peak[MemoryStats::CategoryCount];
+static std::atomic<qint64> s_totalCurrent, s_totalPeak, s_budget;
+
+static void raisePeak(std::atomic<qint64> &peak, qint64 value)
+{
+    qint64 old = peak.load();
+    while (value > old && !peak.compare_exchange_weak(old, value))
+        ;
+}
+
+void MemoryStats::add(Category category, qint64 bytes)
+{
+    if (!bytes)
+        return;
+    raisePeak(s_peak[category], s_current[category] += bytes);
+    raisePeak(s_totalPeak, s_totalCurrent += bytes);
+}
+
+qint64 MemoryStats::current(Category category)
+{
+    return s_current[category];
+}
+
+qint64 MemoryStats::peak(Category category)
+{
+    return s_peak[category];
+}
+
+qint64 MemoryStats::totalCurrent()
+{
+    return s_totalCurrent;
+}
+
+qint64 MemoryStats::totalPeak()
+{
+    return s_totalPeak;
+}
+
+const char *MemoryStats::name(Category category)
+{
+    static const char *names[CategoryCount] = {
+        "generator scratch", "generator output", "upload staging", "BVH", "GPU buffers", "GPU textures"
+    };
+    return names[category];
+}
+
+void MemoryStats::setBudget(qint64 bytes)
+{
+    s_budget = bytes;
+}
+
+qint64 MemoryStats::budget()
+{
+    return s_budget;
+}
+
+bool MemoryStats::fitsBudget(qint64 additionalBytes)
+{
+    const qint64 b = s_budget;
+    return b <= 0 || s_totalCurrent + additionalBytes <= b;
+}
+
+// One line per category, in MB: current / peak.
+QString MemoryStats::report()
+{
+    const double mb = 1024.0 * 1024.0;
+    QString r;
+
+    for (int i = 0; i < CategoryCount; ++i)
+        r += QString("%1: %2 / %3 MB\n").arg(name((Category)i))
+            .arg(s_current[i] / mb, 0, 'f', 1).arg(s_peak[i] / mb, 0, 'f', 1);
+    r += QString("total: %1 / %2 MB").arg(s_totalCurrent / mb, 0, 'f', 1).arg(s_totalPeak / mb, 0, 'f', 1);
+    if (s_budget > 0)
+        r += QString(" (budget %1 MB)").arg(s_budget / mb, 0, 'f', 0);
+    return r;
+}
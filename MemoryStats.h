@@ -0,0 +1,62 @@
+#pragma once
+
+#include <QString>
+
+// Process-wide byte counters, per category, with current and peak values.  Allocation sites report
+// through MemoryCharge (or add() directly); everything is thread-safe.
+class MemoryStats
+{
+public:
+    enum Category
+    {
+        GeneratorScratch,   // per-vertex grid data while generating
+        GeneratorOutput,    // triangle, normal and UV vectors
+        UploadStaging,      // CPU copies queued for the upload thread
+        BVH,
+        GpuBuffers,
+        GpuTextures,
+        CategoryCount
+    };
+
+    static void add(Category category, qint64 bytes);   // negative to release
+    static qint64 current(Category category);
+    static qint64 peak(Category category);
+    static qint64 totalCurrent();
+    static qint64 totalPeak();
+    static const char *name(Category category);
+
+    // Budget for checks made before large allocations; 0 means unlimited.
+    static void setBudget(qint64 bytes);
+    static qint64 budget();
+    static bool fitsBudget(qint64 additionalBytes);
+
+    static QString report();
+};
+
+// Bytes held by one owner in one category.  set() reports the difference; the destructor releases it all.
+class MemoryCharge
+{
+    MemoryStats::Category _category;
+    qint64 _bytes;
+
+public:
+    explicit MemoryCharge(MemoryStats::Category category) : _category(category), _bytes(0) { }
+    MemoryCharge(const MemoryCharge &other) : _category(other._category), _bytes(0) { set(other._bytes); }
+    ~MemoryCharge() { set(0); }
+
+    MemoryCharge &operator=(const MemoryCharge &other)
+    {
+        set(0);
+        _category = other._category;
+        set(other._bytes);
+        return *this;
+    }
+
+    void set(qint64 bytes)
+    {
+        MemoryStats::add(_category, bytes - _bytes);
+        _bytes = bytes;
+    }
+
+    qint64 bytes() const { return _bytes; }
+};
@@ -0,0 +1,91 @@
+#include "ProgressiveRefiner.h"
+
+static const int MinimumSegments = 16;
+
+ProgressiveRefiner::ProgressiveRefiner(QObject *parent) :
+    QThread(parent), _sequence(0), _target(0), _stopping(false)
+{
+}
+
+ProgressiveRefiner::~ProgressiveRefiner()
+{
+    stop();
+}
+
+int ProgressiveRefiner::refine(int segmentCount)
+{
+    QMutexLocker lock(&_mutex);
+    _target = segmentCount;
+    _wake.wakeOne();
+    return ++_sequence;
+}
+
+std::vector<ProgressiveRefiner::Level> ProgressiveRefiner::takeFinished()
+{
+    QMutexLocker lock(&_mutex);
+    std::vector<Level> finished;
+    finished.swap(_finished);
+    return finished;
+}
+
+void ProgressiveRefiner::stop()
+{
+    {
+        QMutexLocker lock(&_mutex);
+        _stopping = true;
+        _wake.wakeOne();
+    }
+    wait();
+}
+
+// Halve while the result stays even-dividing and not below MinimumSegments; e.g., 512 -> 16, 100 -> 25.
+int ProgressiveRefiner::coarsestLevel(int segmentCount)
+{
+    int n = segmentCount;
+    while (n % 2 == 0 && n / 2 >= MinimumSegments)
+        n /= 2;
+    return n;
+}
+
+void ProgressiveRefiner::run()
+{
+    ProjectiveGenerator generator;
+    generator.setReuseVertices(true);
+
+    int sequence = 0, target = 0, level = 0;
+
+    for (;;)
+    {
+        {
+            QMutexLocker lock(&_mutex);
+            while (!_stopping && _sequence == sequence && level >= target)
+                _wake.wait(&_mutex);
+            if (_stopping)
+                break;
+            if (_sequence != sequence) {
+                sequence = _sequence;
+                target = _target;
+                level = coarsestLevel(target);
+            }
+        }
+
+        generator.generate(level, level, true, true);
+
+        Level result;
+        result.sequence = sequence;
+        result.segmentCount = level;
+        result.final = level == target;
+        result.mesh.reset(new ProjectiveGenerator);
+        result.mesh->adoptOutput(generator);
+
+        {
+            QMutexLocker lock(&_mutex);
+            _finished.push_back(result);
+        }
+        emit levelFinished();
+
+        level = level < target ? level * 2 : target + 1;
+    }
+
+    generator.setReuseVertices(false);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include "SurfaceGenerator.h"
+
+// Generates a surface level by level on its own thread: first the coarsest grid that nests into the target
+// resolution, then doubling up to the target.  Each level reuses the vertices of the previous one, so the
+// whole sequence calls F no more often than generating the target directly.  A new refine() abandons the
+// current sequence after the level in progress.
+class ProgressiveRefiner : public QThread
+{
+    Q_OBJECT
+
+public:
+    struct Level
+    {
+        int sequence;                   // of the refine() call this level belongs to
+        int segmentCount;
+        bool final;
+        std::shared_ptr<ProjectiveGenerator> mesh;     // output only; take with SurfaceGenerator::adoptOutput
+    };
+
+    ProgressiveRefiner(QObject *parent = 0);
+    ~ProgressiveRefiner();
+
+    int refine(int segmentCount);       // returns the sequence number of the request
+    std::vector<Level> takeFinished();
+    void stop();
+
+    static int coarsestLevel(int segmentCount);
+
+signals:
+    void levelFinished();
+
+protected:
+    void run() override;
+
+private:
+    QMutex _mutex;
+    QWaitCondition _wake;
+    int _sequence, _target;
+    bool _stopping;
+    std::vector<Level> _finished;
+};
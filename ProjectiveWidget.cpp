@@ -1,12 +1,24 @@
 #include <QKeyEvent>
+#include <QMouseEvent>
+#include <QVector4D>
 #include <QVector3D>
 #include <QtMath>
 #include "ProjectiveWidget.h"
 #include "SurfaceGenerator.h"
 
 ProjectiveWidget::ProjectiveWidget(QWidget*) : 
-    _program(this)
+    _segmentCount(128), _vpWidth(0), _vpHeight(0), _renderWidth(0), _renderHeight(0), _pendingSegmentCount(128),
+    _moveRate(0), _turnRate(0), _heightRate(0), _tiltRate(0), _frameAccumulator(0), _cameraDirty(true),
+    _renderMode(OpaqueMode),
+    _instanceCount(0), _pendingInstanceCount(1), _instanceVbo(0), _instanceBytes(0),
+    _uploader(0), _deformCamera(false), _deformDirty(false),
+    _refiner(0), _progressive(false),
+    _dynamicResolution(false), _targetFrameMs(16.6f), _resolutionScale(1), _frameMsAverage(0), _frameMsSamples(0)
 {
+    for (int i = 0; i < HeldKeyCount; ++i)
+        _held[i] = false;
+    setMouseTracking(true);
+    setFocusPolicy(Qt::StrongFocus);
 }
 
 ProjectiveWidget::~ProjectiveWidget()
@@ -14,29 +26,97 @@ ProjectiveWidget::~ProjectiveWidget()
     cleanup();
 }
 
-void ProjectiveWidget::setSegmentCount(int count)
+// Setters only record the latest requested state; applyPendingState() picks it up at the next frame.
+// Returns false, leaving the count as it was, if the mesh wouldn't fit the memory budget.
+bool ProjectiveWidget::setSegmentCount(int count)
 {
     if (count < 8) count = 8;
-    _segmentCount = count;
-    makeCurrent();
-    setupGeometry();
-    doneCurrent();
+
+    const qint64 required = estimateGeometryBytes(count);
+    if (!MemoryStats::fitsBudget(required - estimateGeometryBytes(_segmentCount))) {
+        emit memoryBudgetExceeded(QString("%1 segments need ~%2 MB; over budget, not generated")
+            .arg(count).arg(required / (1024.0 * 1024.0), 0, 'f', 1));
+        return false;
+    }
+
+    _pendingSegmentCount = count;
+    update();
+    return true;
+}
+
+// Everything a mesh of the given resolution costs: generation, the BVH, the previous output an upload may still
+// hold and the VBOs.
+qint64 ProjectiveWidget::estimateGeometryBytes(int segmentCount)
+{
+    const qint64 vertices = 6 * (qint64)segmentCount * segmentCount;
+    const qint64 vertexBytes = vertices * (2 * sizeof(QVector3D) + sizeof(QVector2D));
+    return SurfaceGenerator::estimateBytes(segmentCount, segmentCount) + SurfaceBVH::estimateBytes(vertices / 3)
+        + 2 * vertexBytes;
+}
+
+void ProjectiveWidget::setRenderMode(int mode)
+{
+    if (mode < BlendMode || mode > OITMode) mode = OpaqueMode;
+    _renderMode = (RenderMode)mode;
+    update();
+}
+
+// Takes effect with the next segment count change.  Turning it off mid-refinement drops the remaining levels;
+// the next frame generates the full resolution directly.
+void ProjectiveWidget::setProgressive(bool progressive)
+{
+    _progressive = progressive;
+    if (!progressive) {
+        _refineSequence = -1;
+        update();
+    }
+}
+
+void ProjectiveWidget::setDynamicResolution(bool enabled)
+{
+    _dynamicResolution = enabled;
+    _resolutionScale = 1;
+    _frameMsAverage = 0;
+    _frameMsSamples = 0;
+    update();
+}
+
+void ProjectiveWidget::setTargetFrameTime(double milliseconds)
+{
+    if (milliseconds < 1) milliseconds = 1;
+    _targetFrameMs = (float)milliseconds;
+    _frameMsAverage = 0;
+    _frameMsSamples = 0;
+    update();
+}
+
+void ProjectiveWidget::setDeformCamera(bool deform)
+{
+    _deformCamera = deform;
+    _deformDirty = true;
+    update();
+}
+
+void ProjectiveWidget::setInstanceCount(int count)
+{
+    if (count < 1) count = 1;
+    _pendingInstanceCount = count;
     update();
 }
 
 void ProjectiveWidget::setCameraU(int u)
 {
-    if (u < 0 || u >= _segmentCount) u = 0;
+    if (u < 0 || u >= _pendingSegmentCount) u = 0;
     _cameraU = u;
-    setupCamera();
+    _cameraDirty = true;
     update();
 }
 
 void ProjectiveWidget::setCameraV(int v)
 {
-    if (v < 0 || v >= _segmentCount) v = 0;
+    if (v < 0 || v >= _pendingSegmentCount) v = 0;
     _cameraV = v;
-    setupCamera();
+    _cameraDirty = true;
     update();
 }
 
@@ -44,14 +124,13 @@ void ProjectiveWidget::setCameraHeight(int height)
 {
     if (height < 0) height = 0;
     _cameraHeight = height / 16.0f;
-    setupCamera();
+    _cameraDirty = true;
     update();
 }
 
 void ProjectiveWidget::compileShaders()
 {
     makeCurrent();
-    _program.release();
     loadProgram();
     doneCurrent();
     update();
@@ -70,104 +149,487 @@ void ProjectiveWidget::initializeGL()
     G->glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     G->glClearColor(0, 0, 0, 1);
 
+    _renderer.initialize(G);
+    G->glGenQueries(QueryFrames, _timeQuery);
+    G->glGenQueries(QueryFrames, _samplesQuery);
+    _queryFrame = 0;
+    _sceneFbo = _sceneRb[0] = _sceneRb[1] = 0;
+    _sceneWidth = _sceneHeight = 0;
+    _sceneBytes = 0;
+
+    // Buffers and the texture are created by the uploader; until they arrive there's nothing to draw.
     G->glGenVertexArrays(1, &_vao);
-    G->glGenBuffers(3, _vbo);
-    G->glGenTextures(1, &_tex);
+    _vbo[0] = _vbo[1] = _vbo[2] = 0;
+    _tex = 0;
+    _vboBytes = _texBytes = 0;
+    _triangleCount = 0;
+    _geometrySequence = _boundGeometrySequence = 0;
+    _uploadFailures = 0;
+    G->glGenBuffers(1, &_instanceVbo);
+
+    _uploader = new GpuUploader(context, this);
+    connect(_uploader, &GpuUploader::uploadFinished, this, static_cast<void (QWidget::*)()>(&QWidget::update),
+        Qt::QueuedConnection);
+    _uploader->start();
+
+    _refiner = new ProgressiveRefiner(this);
+    _refineSequence = -1;
+    connect(_refiner, &ProgressiveRefiner::levelFinished, this,
+        static_cast<void (QWidget::*)()>(&QWidget::update), Qt::QueuedConnection);
+    _refiner->start();
 
-    _segmentCount = 128;
     _cameraU = _cameraV = _cameraHeading = _cameraHeight = _cameraTilt = 0;
     _cameraFOV = 15;
 
     loadProgram();
     setupGeometry();
     setupTexture();
+    _frameClock.start();
 }
 
 void ProjectiveWidget::cleanup()
 {
     makeCurrent();
+
+    if (_refiner) {
+        _refiner->stop();
+        delete _refiner;
+        _refiner = 0;
+    }
+
+    // Objects the uploader created but we never bound are ours to delete.
+    if (_uploader) {
+        _uploader->stop();
+        for (auto &r : _uploader->takeFinished())
+            _pendingUploads.push_back(r);
+        delete _uploader;
+        _uploader = 0;
+    }
+    for (auto &r : _pendingUploads)
+        deleteUpload(r);
+    _pendingUploads.clear();
+
     G->glDeleteVertexArrays(1, &_vao);
     G->glDeleteBuffers(3, _vbo);
     G->glDeleteTextures(1, &_tex);
-    _program.release();
+    G->glDeleteBuffers(1, &_instanceVbo);
+    MemoryStats::add(MemoryStats::GpuBuffers, -_vboBytes - _instanceBytes);
+    MemoryStats::add(MemoryStats::GpuTextures, -_texBytes);
+    _vbo[0] = _vbo[1] = _vbo[2] = _tex = _instanceVbo = 0;
+    _vboBytes = _texBytes = _instanceBytes = 0;
+    _instanceCount = 0;
+
+    _renderer.cleanup();
+    deleteSceneTarget();
+    G->glDeleteQueries(QueryFrames, _timeQuery);
+    G->glDeleteQueries(QueryFrames, _samplesQuery);
+
     doneCurrent();
 }
 
 void ProjectiveWidget::paintGL()
 {
-    G->glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    G->glUniformMatrix4fv(_vmp_i, 1, GL_FALSE, _xform.data());
-    
-    G->glBindVertexArray(_vao);
-    G->glBindTexture(GL_TEXTURE_2D, _tex);
-    G->glUniform1i(_tex_i, 0);
-
-#if 1
-    G->glDrawArrays(GL_TRIANGLES, 0, _triangleCount*3);
-#else
-    for (int i = 0; i < _triangleCount; ++i)
-        G->glDrawArrays(GL_LINE_LOOP, 3*i, 3);
-#endif
+    updateViewportSize();
+    applyPendingState();
+    collectUploads();
+    readFrameQueries();
+
+    const int q = _queryFrame % QueryFrames;
+    G->glBeginQuery(GL_TIME_ELAPSED, _timeQuery[q]);
+
+    setupSceneTarget();
+    _queryScale[q] = _dynamicResolution ? _resolutionScale : 1;
+    _queryPixels[q] = _renderWidth * _renderHeight;
+    // Without scaling the scene goes straight to the widget's framebuffer, whose viewport QOpenGLWidget has
+    // already set.
+    if (_dynamicResolution)
+        G->glViewport(0, 0, _renderWidth, _renderHeight);
+
+    SceneRenderer::Frame frame;
+    frame.target = sceneFramebuffer();
+    frame.width = _renderWidth;
+    frame.height = _renderHeight;
+    frame.vao = _vao;
+    frame.tex = _tex;
+    frame.vertexCount = _triangleCount * 3;
+    frame.instanceCount = _instanceCount;
+    frame.vmp = _xform.constData();
+    frame.samplesQuery = _samplesQuery[q];
+    _renderer.draw((SceneRenderer::Mode)_renderMode, frame);
+
+    // Upscale; part of the measured frame since it costs full-resolution fill.
+    if (_dynamicResolution) {
+        G->glBindFramebuffer(GL_READ_FRAMEBUFFER, _sceneFbo);
+        G->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, defaultFramebufferObject());
+        G->glBlitFramebuffer(0, 0, _renderWidth, _renderHeight, 0, 0, _vpWidth, _vpHeight,
+            GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        G->glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+        G->glViewport(0, 0, _vpWidth, _vpHeight);
+    }
 
-    G->glBindVertexArray(0);
+    G->glEndQuery(GL_TIME_ELAPSED);
+    ++_queryFrame;
     G->glFlush();
+
+    // Keep frames coming while a movement key is held or an upload is in flight; update() is paced by the
+    // swap interval.
+    if (_moveRate || _turnRate || _heightRate || _tiltRate || !_pendingUploads.empty())
+        update();
 }
 
-void ProjectiveWidget::resizeGL(int width, int height)
+GLuint ProjectiveWidget::sceneFramebuffer() const
 {
-    G->glViewport(0, 0, width, height);
+    return _dynamicResolution ? _sceneFbo : defaultFramebufferObject();
+}
+
+// Size the render target for this frame.  The scene FBO only exists while dynamic resolution is on, and is
+// reallocated only when the (quantized) scale or the viewport changes.
+void ProjectiveWidget::setupSceneTarget()
+{
+    if (!_dynamicResolution) {
+        deleteSceneTarget();
+        _renderWidth = _vpWidth;
+        _renderHeight = _vpHeight;
+        return;
+    }
+
+    _renderWidth = qMax(1, qRound(_vpWidth * _resolutionScale));
+    _renderHeight = qMax(1, qRound(_vpHeight * _resolutionScale));
+    if (_sceneFbo && _sceneWidth == _renderWidth && _sceneHeight == _renderHeight)
+        return;
+
+    deleteSceneTarget();
+    _sceneWidth = _renderWidth;
+    _sceneHeight = _renderHeight;
+
+    G->glGenFramebuffers(1, &_sceneFbo);
+    G->glGenRenderbuffers(2, _sceneRb);
+    G->glBindRenderbuffer(GL_RENDERBUFFER, _sceneRb[0]);
+    G->glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, _sceneWidth, _sceneHeight);
+    G->glBindRenderbuffer(GL_RENDERBUFFER, _sceneRb[1]);
+    G->glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, _sceneWidth, _sceneHeight);
+    G->glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    G->glBindFramebuffer(GL_FRAMEBUFFER, _sceneFbo);
+    G->glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, _sceneRb[0]);
+    G->glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, _sceneRb[1]);
+    if (G->glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        qDebug() << "SCENE FRAMEBUFFER INCOMPLETE";
+    G->glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+
+    _sceneBytes = (qint64)_sceneWidth * _sceneHeight * (4 + 4);
+    MemoryStats::add(MemoryStats::GpuTextures, _sceneBytes);
+}
+
+void ProjectiveWidget::deleteSceneTarget()
+{
+    if (!_sceneFbo)
+        return;
+    G->glDeleteFramebuffers(1, &_sceneFbo);
+    G->glDeleteRenderbuffers(2, _sceneRb);
+    _sceneFbo = _sceneRb[0] = _sceneRb[1] = 0;
+    _sceneWidth = _sceneHeight = 0;
+    MemoryStats::add(MemoryStats::GpuTextures, -_sceneBytes);
+    _sceneBytes = 0;
+}
+
+// Results of the frame QueryFrames-1 frames back.  Never waits: if the GPU is still behind, that frame's
+// numbers are skipped.
+void ProjectiveWidget::readFrameQueries()
+{
+    const int q = _queryFrame % QueryFrames;
+    GLuint available = 0, samples = 0;
+    GLuint64 elapsed = 0;
+
+    if (_queryFrame < QueryFrames)
+        return;
+
+    G->glGetQueryObjectuiv(_timeQuery[q], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+        return;
+    G->glGetQueryObjectuiv(_samplesQuery[q], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+        return;
+
+    G->glGetQueryObjectui64v(_timeQuery[q], GL_QUERY_RESULT, &elapsed);
+    G->glGetQueryObjectuiv(_samplesQuery[q], GL_QUERY_RESULT, &samples);
+    emit frameStats(elapsed / 1e6f, (float)samples / qMax(1, _queryPixels[q]));
+
+    // Frames drawn before the last scale change say nothing about the current scale.
+    if (_dynamicResolution && _queryScale[q] == _resolutionScale)
+        adjustResolution(elapsed / 1e6f);
+}
+
+// Fill cost goes with the pixel count, i.e., with the square of the scale, so the scale that would hit the
+// target is scale * sqrt(target / measured).  Only step halfway there, as part of the frame doesn't scale, and
+// not at all inside a deadband around the target; together with the quantization to 1/32 steps this keeps the
+// scale (and the FBO) from changing every frame.
+void ProjectiveWidget::adjustResolution(float gpuMilliseconds)
+{
+    const float minScale = 0.25f;
+    const int settleFrames = 4;
+
+    _frameMsAverage = _frameMsSamples ? 0.8f * _frameMsAverage + 0.2f * gpuMilliseconds : gpuMilliseconds;
+    if (++_frameMsSamples >= settleFrames) {
+        const float ratio = _targetFrameMs / qMax(_frameMsAverage, 0.01f);
+        if (ratio < 0.95f || ratio > 1.15f) {
+            const float ideal = _resolutionScale * sqrtf(ratio);
+            float scale = qRound((_resolutionScale + 0.5f * (ideal - _resolutionScale)) * 32) / 32.0f;
+            if (scale == _resolutionScale)
+                scale += ratio > 1 ? 1 / 32.0f : -1 / 32.0f;
+            scale = qBound(minScale, scale, 1.0f);
+            if (scale != _resolutionScale) {
+                _resolutionScale = scale;
+                _frameMsSamples = 0;
+            }
+        }
+    }
+
+    emit resolutionStats(_resolutionScale, qMax(1, qRound(_vpWidth * _resolutionScale)),
+        qMax(1, qRound(_vpHeight * _resolutionScale)), _frameMsAverage);
+}
+
+void ProjectiveWidget::resizeGL(int, int)
+{
+    updateViewportSize();
+}
+
+// resizeGL() gets the size in logical pixels, but every render target, the blit and the overdraw count work in
+// device pixels.  Also refreshed per frame, since moving to a screen with another pixel ratio need not resize.
+void ProjectiveWidget::updateViewportSize()
+{
+    const qreal ratio = devicePixelRatioF();
+    const int width = qMax(1, qRound(this->width() * ratio));
+    const int height = qMax(1, qRound(this->height() * ratio));
+    if (width == _vpWidth && height == _vpHeight)
+        return;
+
     _vpWidth = width; _vpHeight = height;
-    setupCamera();
+    _renderWidth = width; _renderHeight = height;
+    _cameraDirty = true;
 }
 
+// Movement keys only record what is held; the motion itself is integrated by advanceFrame() at a fixed rate,
+// so OS key-repeat neither paces nor floods it.  Discrete keys (FOV) still act once per press.
 void ProjectiveWidget::keyPressEvent(QKeyEvent *ev)
 {
-    const float uvstep = 1e-2f;
-    const float htstep = 1e-1f;
-    bool changed1 = true, changed2 = true;
+    if (ev->isAutoRepeat())
+        return;
 
-    {
-        float move = 0;
+    if (!setHeldKey(ev, true)) {
+        if (ev->text().isEmpty())
+            return;
 
-        switch (ev->key())
+        switch (ev->text().toLatin1().at(0))
         {
-        case Qt::Key_Down: move = -uvstep; break;
-        case Qt::Key_Up: move = uvstep; break;
-        case Qt::Key_Left: _cameraHeading = fmodf(_cameraHeading + 360 - 15, 360); break;
-        case Qt::Key_Right: _cameraHeading = fmodf(_cameraHeading + 15, 360); break;
-        default: changed1 = false;
+        case 'F': _cameraFOV = qMin(60.f, _cameraFOV+5); break;
+        case 'f': _cameraFOV = qMax(5.f, _cameraFOV-5); break;
+        default: QOpenGLWidget::keyPressEvent(ev); return;
         }
+        emit cameraProjectionTargetChanged(QVector3D(_cameraHeight, _cameraTilt, _cameraFOV));
+        _cameraDirty = true;
+    }
+    update();
+}
+
+void ProjectiveWidget::keyReleaseEvent(QKeyEvent *ev)
+{
+    if (ev->isAutoRepeat() || !setHeldKey(ev, false))
+        QOpenGLWidget::keyReleaseEvent(ev);
+}
+
+// No release arrives for keys still down when focus moves elsewhere, so let go of all of them.
+void ProjectiveWidget::focusOutEvent(QFocusEvent *ev)
+{
+    for (int i = 0; i < HeldKeyCount; ++i)
+        _held[i] = false;
+    _moveRate = _turnRate = _heightRate = _tiltRate = 0;
+    QOpenGLWidget::focusOutEvent(ev);
+}
+
+// Returns false if the key is not a movement key.
+bool ProjectiveWidget::setHeldKey(QKeyEvent *ev, bool pressed)
+{
+    const bool wasIdle = !_moveRate && !_turnRate && !_heightRate && !_tiltRate;
+    const bool shift = (ev->modifiers() & Qt::ShiftModifier) != 0;
+
+    // H and T move up with shift and down without; the shift state may differ between press and release, so a
+    // release lets go of both directions.
+    switch (ev->key())
+    {
+    case Qt::Key_Up: _held[MoveForward] = pressed; break;
+    case Qt::Key_Down: _held[MoveBack] = pressed; break;
+    case Qt::Key_Right: _held[TurnRight] = pressed; break;
+    case Qt::Key_Left: _held[TurnLeft] = pressed; break;
+    case Qt::Key_H:
+        _held[HeightUp] = pressed && shift;
+        _held[HeightDown] = pressed && !shift;
+        break;
+    case Qt::Key_T:
+        _held[TiltUp] = pressed && shift;
+        _held[TiltDown] = pressed && !shift;
+        break;
+    default: return false;
+    }
 
-        _cameraU = fmodf(_cameraU + 1 + uvstep*cos(qDegreesToRadians(_cameraHeading)), 1);
-        _cameraV = fmodf(_cameraV + 1 + uvstep*sin(qDegreesToRadians(_cameraHeading)), 1);
+    // Opposite keys held together cancel; releasing one leaves the other in effect.
+    _moveRate = (float)_held[MoveForward] - _held[MoveBack];
+    _turnRate = (float)_held[TurnRight] - _held[TurnLeft];
+    _heightRate = (float)_held[HeightUp] - _held[HeightDown];
+    _tiltRate = (float)_held[TiltUp] - _held[TiltDown];
 
-        if (changed1)
-            emit cameraSurfacePositionChanged(QVector3D(_cameraU, _cameraV, _cameraHeading));
+    // Don't integrate the time spent idle.
+    if (pressed && wasIdle) {
+        _frameClock.restart();
+        _frameAccumulator = 0;
     }
+    return true;
+}
+
+// Integrate held-key motion in fixed steps over the real time elapsed since the previous frame.
+void ProjectiveWidget::advanceFrame()
+{
+    const float step = 1.0f / 120;
+    const float moveSpeed = 0.25f * _segmentCount;  // grid units per second
+    const float turnSpeed = 90;                     // degrees per second
+    const float heightSpeed = 1;
+
+    if (!_moveRate && !_turnRate && !_heightRate && !_tiltRate)
+        return;
 
+    // Clamp so that a stall (e.g., regenerating a large mesh) doesn't turn into a jump.
+    _frameAccumulator = qMin(_frameAccumulator + _frameClock.restart() / 1000.0f, 0.25f);
+
+    for (; _frameAccumulator >= step; _frameAccumulator -= step)
     {
-        if (ev->text().isEmpty())
-            return;
+        const float move = _moveRate * moveSpeed * step;
+        _cameraHeading = fmodf(_cameraHeading + 360 + _turnRate * turnSpeed * step, 360);
+        _cameraU = fmodf(_cameraU + _segmentCount + move * cos(qDegreesToRadians(_cameraHeading)), _segmentCount);
+        _cameraV = fmodf(_cameraV + _segmentCount + move * sin(qDegreesToRadians(_cameraHeading)), _segmentCount);
+        _cameraHeight += _heightRate * heightSpeed * step;
+        _cameraTilt += _tiltRate * heightSpeed * step;
+    }
 
-        char key = ev->text().toLatin1().at(0);
+    emit cameraSurfacePositionChanged(QVector3D(_cameraU, _cameraV, _cameraHeading));
+    if (_heightRate || _tiltRate)
+        emit cameraProjectionTargetChanged(QVector3D(_cameraHeight, _cameraTilt, _cameraFOV));
+    _cameraDirty = true;
+}
 
-        switch (key)
-        {
-        case 'H': _cameraHeight += htstep; break;
-        case 'h': _cameraHeight -= htstep; break;
-        case 'T': _cameraTilt += htstep; break;
-        case 't': _cameraTilt -= htstep; break;
-        case 'F': _cameraFOV = qMax(60.f, _cameraFOV+5); break;
-        case 'f': _cameraFOV = qMin(5.f, _cameraFOV-5); break;
-        default: changed2 = false;
+// Apply everything accumulated since the last frame; at most one regeneration and one camera update per frame.
+void ProjectiveWidget::applyPendingState()
+{
+    advanceFrame();
+
+    if (_pendingSegmentCount != _segmentCount) {
+        // Keep the camera at the same place on the surface; its position is in grid units.
+        const float rescale = (float)_pendingSegmentCount / _segmentCount;
+        _segmentCount = _pendingSegmentCount;
+        _cameraU = fmodf(_cameraU * rescale, _segmentCount);
+        _cameraV = fmodf(_cameraV * rescale, _segmentCount);
+        emit cameraSurfacePositionChanged(QVector3D(_cameraU, _cameraV, _cameraHeading));
+        if (_progressive)
+            _refineSequence = _refiner->refine(_segmentCount);
+        else
+            setupGeometry();
+        _cameraDirty = true;
+    } else if (!_progressive && _shapeData.getUSegmentCount() != _segmentCount) {
+        // A coarse level left over from a refinement that was switched off.
+        setupGeometry();
+        _cameraDirty = true;
+    }
+
+    // Only the newest finished level of the current request is worth uploading.  After the final one the request
+    // is done, and nothing else is accepted until the next.
+    {
+        auto levels = _refiner->takeFinished();
+        for (auto it = levels.rbegin(); it != levels.rend(); ++it) {
+            if (it->sequence == _refineSequence) {
+                if (it->final)
+                    _refineSequence = -1;
+                _shapeData.adoptOutput(*it->mesh);
+                uploadGeometry();
+                _cameraDirty = true;
+                break;
+            }
         }
+    }
 
-        if (changed2)
-            emit cameraProjectionTargetChanged(QVector3D(_cameraHeight, _cameraTilt, _cameraFOV));
+    if (_pendingInstanceCount != _instanceCount) {
+        _instanceCount = _pendingInstanceCount;
+        setupInstances();
     }
 
-    if (changed1 || changed2)
-        update();
+    if (_deformDirty || (_deformCamera && _cameraDirty))
+        placeDeformation();
+    updateGeometryChunks();
+
+    if (_cameraDirty) {
+        setupCamera();
+        _cameraDirty = false;
+    }
+}
+
+// Hover reports what is under the cursor; clicking also moves the camera there.
+void ProjectiveWidget::mouseMoveEvent(QMouseEvent *ev)
+{
+    QVector2D uv;
+    QVector3D position, normal;
+
+    if (pickSurface(ev->pos(), uv, position, normal))
+        emit surfacePicked(uv, position, normal);
+}
+
+void ProjectiveWidget::mousePressEvent(QMouseEvent *ev)
+{
+    QVector2D uv;
+    QVector3D position, normal;
+
+    if (ev->button() != Qt::LeftButton || !pickSurface(ev->pos(), uv, position, normal)) {
+        QOpenGLWidget::mousePressEvent(ev);
+        return;
+    }
+
+    _cameraU = fmodf(uv.x(), _segmentCount);
+    _cameraV = fmodf(uv.y(), _segmentCount);
+    _cameraDirty = true;
+    update();
+
+    emit surfacePicked(uv, position, normal);
+    emit cameraSurfacePositionChanged(QVector3D(_cameraU, _cameraV, _cameraHeading));
+}
+
+// Cast a ray through the pixel at pos and find the nearest surface point.  uv is in grid units, like _cameraU/V;
+// position and normal are in model space.
+bool ProjectiveWidget::pickSurface(const QPoint &pos, QVector2D &uv, QVector3D &position, QVector3D &normal) const
+{
+    if (_bvh.isEmpty() || width() <= 0 || height() <= 0)
+        return false;
+
+    // Only instance 0 is pickable; its model is the identity and its param (y scale) is 0.5.
+    QMatrix4x4 model;
+    model.scale(1, 0.5f, 1);
+    const QMatrix4x4 inv = (_xform * model).inverted();
+
+    const float x = 2 * (pos.x() + 0.5f) / width() - 1;
+    const float y = 1 - 2 * (pos.y() + 0.5f) / height();
+    const QVector3D origin = (inv * QVector4D(x, y, -1, 1)).toVector3DAffine();
+    const QVector3D direction = (inv * QVector4D(x, y, 1, 1)).toVector3DAffine() - origin;
+
+    const auto &triangles = _shapeData.getTriangles();
+    const auto &normals = _shapeData.getNormals();
+    SurfaceBVH::Hit hit;
+
+    if (!_bvh.intersect(triangles, origin, direction, hit))
+        return false;
+
+    const int i = 3 * hit.triangle;
+    const float b0 = 1 - hit.b1 - hit.b2;
+    uv = _shapeData.triangleUV(hit.triangle, hit.b1, hit.b2);
+    uv *= (float)_segmentCount / _shapeData.getUSegmentCount();    // coarser while refining
+    position = b0 * triangles[i] + hit.b1 * triangles[i+1] + hit.b2 * triangles[i+2];
+    normal = (b0 * normals[i] + hit.b1 * normals[i+1] + hit.b2 * normals[i+2]).normalized();
+    return true;
 }
 
 void ProjectiveWidget::setupCamera()
@@ -175,14 +637,17 @@ void ProjectiveWidget::setupCamera()
     QMatrix4x4 cameraXform, perspXform;
 
     {
-        const int i = 6 * _shapeData.uvIndex(_cameraU, _cameraV);
+        // While refining, _shapeData may be coarser than _segmentCount, which the camera position is in.
+        const int n = _shapeData.getUSegmentCount();
+        const float scale = (float)n / _segmentCount;
+        const int i = 6 * _shapeData.quadIndex((int)(_cameraU * scale) % n, (int)(_cameraV * scale) % n);
 
-        auto triangles = _shapeData.getTriangles();
+        const auto &triangles = _shapeData.getTriangles();
         QVector3D eye = triangles[i];    // 6 value per uv index
         QVector3D center = triangles[i+1];
         center.setZ(_cameraHeight-1);
 
-        auto normals = _shapeData.getNormals();
+        const auto &normals = _shapeData.getNormals();
         QVector3D up(0, normals[i].y(), 0);// = normals[i];
 
         cameraXform.lookAt(eye, center, up);
@@ -193,32 +658,35 @@ void ProjectiveWidget::setupCamera()
     _xform = perspXform * cameraXform;
 }
 
+// Generation stays on this thread (unless progressive), but the GL upload is handed to the uploader; the old buffers keep being
+// drawn until collectUploads() sees the new ones are ready.
 void ProjectiveWidget::setupGeometry()
 {
     _shapeData.generate(_segmentCount, _segmentCount, true, true);
+    uploadGeometry();
+}
 
-    G->glBindVertexArray(_vao);
-
-    auto triangles = _shapeData.getTriangles();
-    G->glBindBuffer(GL_ARRAY_BUFFER, _vbo[0]);
-    G->glBufferData(GL_ARRAY_BUFFER, triangles.size() * sizeof(QVector3D), &triangles[0], GL_STATIC_DRAW);
-    G->glVertexAttribPointer(_vertex_position_i, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-    G->glEnableVertexAttribArray(_vertex_position_i);
-    _triangleCount = triangles.size() / 3;
-
-    auto normals = _shapeData.getNormals();
-    G->glBindBuffer(GL_ARRAY_BUFFER, _vbo[1]);
-    G->glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(QVector3D), &normals[0], GL_STATIC_DRAW);
-    G->glVertexAttribPointer(_vertex_normal_i, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-    G->glEnableVertexAttribArray(_vertex_normal_i);
-
-    auto uvs = _shapeData.getUVs();
-    G->glBindBuffer(GL_ARRAY_BUFFER, _vbo[2]);
-    G->glBufferData(GL_ARRAY_BUFFER, uvs.size() * sizeof(QVector2D), &uvs[0], GL_STATIC_DRAW);
-    G->glVertexAttribPointer(_vertex_uv_i, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
-    G->glEnableVertexAttribArray(_vertex_uv_i);
+// Rebuild the BVH for and upload whatever _shapeData currently holds, including pending chunk updates.
+void ProjectiveWidget::uploadGeometry()
+{
+    _shapeData.updateDirtyChunks();
+    _rangesSinceUpload.clear();
+    _bvh.build(_shapeData.getTriangles());
+    emit meshReady(_shapeData.getUSegmentCount(), _shapeData.getEvaluationCount());
+    submitGeometry();
+}
 
-    G->glBindVertexArray(0);
+// Hand _shapeData's buffers to the uploader as the newest geometry.  They are shared, not copied; chunk updates
+// before the upload is done copy them first (SurfaceGenerator::detachOutput()).
+void ProjectiveWidget::submitGeometry()
+{
+    GpuUploader::Request request;
+    request.kind = GeometryUpload;
+    request.sequence = ++_geometrySequence;
+    request.buffers.push_back(GpuUploader::share(_shapeData.shareTriangles()));
+    request.buffers.push_back(GpuUploader::share(_shapeData.shareNormals()));
+    request.buffers.push_back(GpuUploader::share(_shapeData.shareUVs()));
+    _uploader->submit(std::move(request));
 }
 
 void ProjectiveWidget::setupTexture()
@@ -229,58 +697,170 @@ void ProjectiveWidget::setupTexture()
         return;
     }
 
-    auto bits = img.constBits();
-    auto width = img.width();
-    auto height = img.height();
+    GpuUploader::Request request;
+    request.kind = TextureUpload;
+    request.sequence = 0;
+    request.image = img;
+    _uploader->submit(std::move(request));
+}
+
+// Adopt finished uploads whose fences have signalled, in submission order.  Never blocks: an upload that
+// isn't complete yet is retried next frame.  Geometry superseded by a later request is deleted unused.
+void ProjectiveWidget::collectUploads()
+{
+    for (auto &r : _uploader->takeFinished())
+        _pendingUploads.push_back(r);
+
+    while (!_pendingUploads.empty())
+    {
+        GpuUploader::Result &r = _pendingUploads.front();
+        GLenum status = G->glClientWaitSync(r.fence, 0, 0);
+        if (status == GL_TIMEOUT_EXPIRED)
+            break;
+
+        // The objects can't be trusted to hold the data; drop them and upload again, unless they were
+        // superseded anyway.
+        if (status == GL_WAIT_FAILED) {
+            qDebug() << "UPLOAD FENCE WAIT FAILED";
+            const int kind = r.kind;
+            const bool current = kind == TextureUpload || r.sequence == _geometrySequence;
+            deleteUpload(r);
+            _pendingUploads.erase(_pendingUploads.begin());
+            if (current && ++_uploadFailures > MaxUploadRetries) {
+                qDebug() << "UPLOAD FAILED" << _uploadFailures << "TIMES, GIVING UP";
+            } else if (current && kind == TextureUpload) {
+                setupTexture();
+            } else if (current) {
+                _rangesSinceUpload.clear();
+                submitGeometry();
+            }
+            continue;
+        }
+
+        G->glDeleteSync(r.fence);
+        r.fence = 0;
+        _uploadFailures = 0;
+
+        if (r.kind == GeometryUpload && r.sequence == _geometrySequence) {
+            G->glDeleteBuffers(3, _vbo);
+            MemoryStats::add(MemoryStats::GpuBuffers, -_vboBytes);
+            _vboBytes = r.bufferBytes;
+            for (int i = 0; i < 3; ++i)
+                _vbo[i] = r.buffers[i];
+            _triangleCount = (int)_shapeData.getTriangles().size() / 3;
+            _boundGeometrySequence = r.sequence;
+            bindGeometry();
+            uploadRanges(_rangesSinceUpload);
+            _rangesSinceUpload.clear();
+        } else if (r.kind == TextureUpload) {
+            G->glDeleteTextures(1, &_tex);
+            MemoryStats::add(MemoryStats::GpuTextures, -_texBytes);
+            _texBytes = r.textureBytes;
+            _tex = r.texture;
+        } else {
+            deleteUpload(r);
+        }
 
-    G->glActiveTexture(GL_TEXTURE0);
-    G->glBindTexture(GL_TEXTURE_2D, _tex);
-    G->glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    G->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    G->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    // GRRR, img.format() is RGB32 with alpha forced to 0xFF
-    G->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, bits);
+        _pendingUploads.erase(_pendingUploads.begin());
+    }
 }
 
-void ProjectiveWidget::loadProgram()
+// Move the bump to the camera.  In UV units, so that it stays put across resolution changes.
+void ProjectiveWidget::placeDeformation()
 {
-    QString compileMessages;
+    const QVector2D uv(_cameraU / _segmentCount, _cameraV / _segmentCount);
 
-    _program.removeAllShaders();
+    if (!_deformDirty && uv == _deformUV)
+        return;
+    _deformDirty = false;
+    _deformUV = uv;
 
-    compileMessages = "VERTEX SHADER LOG:\n";
-    if (!_program.addShaderFromSourceFile(QOpenGLShader::Vertex, "Shaders/Perspective.txt"))
-        compileMessages += _program.log() + "\n";
+    _shapeData.clearBumps();
+    if (_deformCamera)
+        _shapeData.addBump(uv, 0.05f, 0.25f);
+}
 
-    compileMessages += "FRAGMENT SHADER LOG:\n";
-    if (!_program.addShaderFromSourceFile(QOpenGLShader::Fragment, "Shaders/Fragment.txt"))
-        compileMessages += _program.log() + "\n";
+// Recompute the chunks the deformation touched, refit the BVH over them and update just their byte ranges of
+// the position and normal buffers.  If newer geometry is still being uploaded, _vbo has another layout; the
+// ranges are then applied when the new buffers are bound.
+void ProjectiveWidget::updateGeometryChunks()
+{
+    if (!_shapeData.hasDirtyChunks())
+        return;
 
-    compileMessages += "LINK LOG:\n";
-    if (!_program.link())
-        compileMessages += _program.log() + "\n";
-    
-    _program.bind();
+    QElapsedTimer timer;
+    timer.start();
 
-    GLuint p = _program.programId();
+    const auto ranges = _shapeData.updateDirtyChunks();
+    int vertexCount = 0;
+    for (const auto &r : ranges) {
+        _bvh.refit(_shapeData.getTriangles(), r.first / 3, r.count / 3);
+        vertexCount += r.count;
+    }
 
-    // WTF? glGetAttribLocation will return -1 for vertex_normal unless it is somehow used in the program.
-    // Hardcode this for now.
-#if 0
-    _vertex_position_i = G->glGetAttribLocation(p, "vertex_position");
-    _vertex_normal_i = G->glGetAttribLocation(p, "vertex_normal");
-    _vertex_uv_i = G->glGetAttribLocation(p, "vertex_uv");
-#else
-    if (G->glGetAttribLocation(p, "vertex_normal") < 0)
-      compileMessages += "VERTEX NORMAL OPTIMIZED OUT\n";
+    if (_boundGeometrySequence != _geometrySequence)
+        _rangesSinceUpload.insert(_rangesSinceUpload.end(), ranges.begin(), ranges.end());
+    else
+        uploadRanges(ranges);
 
-    _vertex_position_i = 0;
-    _vertex_normal_i = 1;
-    _vertex_uv_i = 2;
-#endif
+    emit chunksUpdated(vertexCount, 2 * vertexCount * (qint64)sizeof(QVector3D), timer.nsecsElapsed() / 1e6f);
+    _cameraDirty = true;
+}
 
-    _vmp_i = G->glGetUniformLocation(p, "vmp");
-    _tex_i = G->glGetUniformLocation(p, "tex");
+void ProjectiveWidget::uploadRanges(const std::vector<SurfaceGenerator::Range> &ranges)
+{
+    const std::vector<QVector3D> *data[2] = { &_shapeData.getTriangles(), &_shapeData.getNormals() };
 
-    emit compilationDone(compileMessages);
+    for (int b = 0; b < 2; ++b) {
+        G->glBindBuffer(GL_ARRAY_BUFFER, _vbo[b]);
+        for (const auto &r : ranges)
+            G->glBufferSubData(GL_ARRAY_BUFFER, r.first * sizeof(QVector3D), r.count * sizeof(QVector3D),
+                &(*data[b])[r.first]);
+    }
+    G->glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void ProjectiveWidget::deleteUpload(GpuUploader::Result &r)
+{
+    if (r.fence)
+        G->glDeleteSync(r.fence);
+    if (!r.buffers.empty())
+        G->glDeleteBuffers((GLsizei)r.buffers.size(), &r.buffers[0]);
+    if (r.texture)
+        G->glDeleteTextures(1, &r.texture);
+    MemoryStats::add(MemoryStats::GpuBuffers, -r.bufferBytes);
+    MemoryStats::add(MemoryStats::GpuTextures, -r.textureBytes);
+}
+
+// Instance 0 stays at the origin, where the camera lives.  The rest are laid out on a square grid in the
+// XY plane with random rotation, y scale and tint; the seed is fixed so a given count always gives the same scene.
+void ProjectiveWidget::setupInstances()
+{
+    const qint64 bytes = _renderer.setupInstances(_vao, _instanceVbo, _instanceCount);
+    MemoryStats::add(MemoryStats::GpuBuffers, bytes - _instanceBytes);
+    _instanceBytes = bytes;
+}
+
+void ProjectiveWidget::bindGeometry()
+{
+    G->glBindVertexArray(_vao);
+
+    G->glBindBuffer(GL_ARRAY_BUFFER, _vbo[0]);
+    G->glVertexAttribPointer(SceneRenderer::PositionAttribute, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    G->glEnableVertexAttribArray(SceneRenderer::PositionAttribute);
+
+    G->glBindBuffer(GL_ARRAY_BUFFER, _vbo[1]);
+    G->glVertexAttribPointer(SceneRenderer::NormalAttribute, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    G->glEnableVertexAttribArray(SceneRenderer::NormalAttribute);
+
+    G->glBindBuffer(GL_ARRAY_BUFFER, _vbo[2]);
+    G->glVertexAttribPointer(SceneRenderer::UVAttribute, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    G->glEnableVertexAttribArray(SceneRenderer::UVAttribute);
+
+    G->glBindVertexArray(0);
+}
+
+void ProjectiveWidget::loadProgram()
+{
+    emit compilationDone(_renderer.loadPrograms());
 }
@@ -8,7 +8,12 @@
 #include <QOpenGLTexture>
 #include <QOpenGLFunctions_3_3_core>
 #include <QMatrix4x4>
+#include <QElapsedTimer>
 #include "SurfaceGenerator.h"
+#include "SurfaceBVH.h"
+#include "SceneRenderer.h"
+#include "GpuUploader.h"
+#include "ProgressiveRefiner.h"
 
 QT_FORWARD_DECLARE_CLASS(QOpenGLShaderProgram)
 
@@ -17,6 +22,9 @@ class ProjectiveWidget : public QOpenGLWidget
     Q_OBJECT
 
 public:
+    enum RenderMode { BlendMode = SceneRenderer::BlendMode, OpaqueMode = SceneRenderer::OpaqueMode,
+        PrepassMode = SceneRenderer::PrepassMode, OITMode = SceneRenderer::OITMode };
+
     ProjectiveWidget(QWidget *parent = 0);
     ~ProjectiveWidget();
 
@@ -24,7 +32,13 @@ public:
     QSize sizeHint() const override { return QSize(800, 600); }
 
 public slots:
-    void setSegmentCount(int count);
+    bool setSegmentCount(int count);
+    void setInstanceCount(int count);
+    void setRenderMode(int mode);
+    void setProgressive(bool progressive);
+    void setDynamicResolution(bool enabled);
+    void setTargetFrameTime(double milliseconds);
+    void setDeformCamera(bool deform);
     void setCameraU(int u);
     void setCameraV(int v);
     void setCameraHeight(int height);
@@ -35,34 +49,118 @@ public slots:
 signals:
     void cameraSurfacePositionChanged(const QVector3D newPosition);
     void cameraProjectionTargetChanged(const QVector3D newProjectionTarget);
+    void surfacePicked(const QVector2D uv, const QVector3D position, const QVector3D normal);
     void compilationDone(const QString &msg);
+    void memoryBudgetExceeded(const QString &msg);
+    void frameStats(float gpuMilliseconds, float overdraw);
+    void meshReady(int segmentCount, int evaluations);
+    void resolutionStats(float scale, int width, int height, float averageMilliseconds);
+    void chunksUpdated(int vertexCount, qint64 bytes, float milliseconds);
 
 protected:
     void initializeGL() override;
     void paintGL() override;
     void resizeGL(int width, int height) override;
     void keyPressEvent(QKeyEvent *ev) override;
+    void keyReleaseEvent(QKeyEvent *ev) override;
+    void focusOutEvent(QFocusEvent *ev) override;
+    void mouseMoveEvent(QMouseEvent *ev) override;
+    void mousePressEvent(QMouseEvent *ev) override;
 
 private:
     void loadProgram();
+    void readFrameQueries();
+    void adjustResolution(float gpuMilliseconds);
+    void updateViewportSize();
+    void setupSceneTarget();
+    void deleteSceneTarget();
+    GLuint sceneFramebuffer() const;
     void setupGeometry();
     void setupTexture();
+    void uploadGeometry();
+    void submitGeometry();
+    void bindGeometry();
+    void placeDeformation();
+    void updateGeometryChunks();
+    void uploadRanges(const std::vector<SurfaceGenerator::Range> &ranges);
+    void setupInstances();
+    void collectUploads();
+    void deleteUpload(GpuUploader::Result &r);
     void setupCamera();
+    static qint64 estimateGeometryBytes(int segmentCount);
+    bool setHeldKey(QKeyEvent *ev, bool pressed);
+    void advanceFrame();
+    void applyPendingState();
+    bool pickSurface(const QPoint &pos, QVector2D &uv, QVector3D &position, QVector3D &normal) const;
 
     // Camera position & orientation.
     int _segmentCount;
     int _vpWidth, _vpHeight;                        // viewport
+    int _renderWidth, _renderHeight;                // what the scene is drawn at; smaller with dynamic resolution
     float _cameraU, _cameraV, _cameraHeading;       // camera position & movement direction on the surface
     float _cameraHeight, _cameraTilt, _cameraFOV;   // how high above camera is & up/down tilt
 
+    // Input coalescing: latest requested state, applied once per frame.
+    int _pendingSegmentCount;
+    enum HeldKey { MoveForward, MoveBack, TurnRight, TurnLeft, HeightUp, HeightDown, TiltUp, TiltDown, HeldKeyCount };
+    bool _held[HeldKeyCount];
+    float _moveRate, _turnRate, _heightRate, _tiltRate; // -1, 0, 1 from the held keys
+    QElapsedTimer _frameClock;
+    float _frameAccumulator;                        // seconds not yet integrated
+    bool _cameraDirty;
+
     // OpenGL stuff.
     ProjectiveGenerator _shapeData;
+    SurfaceBVH _bvh;
     int _triangleCount;
     QMatrix4x4 _xform;
 
+    RenderMode _renderMode;
+    SceneRenderer _renderer;
+
+    // Instanced rendering: the whole scene is one instanced draw of the surface.
+    int _instanceCount, _pendingInstanceCount;
+    GLuint _instanceVbo;
+    qint64 _instanceBytes;
+
+    // Uploads in flight; _geometrySequence identifies the latest geometry request, _boundGeometrySequence the
+    // one in _vbo.  Chunks updated while they differ are replayed into the new buffers once they are bound.
+    enum { GeometryUpload, TextureUpload };
+    GpuUploader *_uploader;
+    std::vector<GpuUploader::Result> _pendingUploads;
+    int _geometrySequence, _boundGeometrySequence;
+    static const int MaxUploadRetries = 3;
+    int _uploadFailures;                            // consecutive failed fences
+    std::vector<SurfaceGenerator::Range> _rangesSinceUpload;
+
+    // Local deformation that follows the camera, at _deformUV.
+    bool _deformCamera, _deformDirty;
+    QVector2D _deformUV;
+
+    // Progressive refinement; _refineSequence is the request whose levels are accepted, -1 for none.
+    ProgressiveRefiner *_refiner;
+    bool _progressive;
+    int _refineSequence;
+
     QOpenGLFunctions_3_3_Core *G;
     GLuint _vao, _vbo[3], _tex;
-    GLint _vertex_position_i, _vertex_normal_i, _vertex_uv_i, _vmp_i, _tex_i;
-    QOpenGLShaderProgram _program;
+    qint64 _vboBytes, _texBytes;
+
+    // Per-frame GPU time and samples-passed queries, read back QueryFrames-1 frames later, with the resolution
+    // scale and pixel count each frame was drawn at.
+    static const int QueryFrames = 3;
+    GLuint _timeQuery[QueryFrames], _samplesQuery[QueryFrames];
+    float _queryScale[QueryFrames];
+    int _queryPixels[QueryFrames];
+    int _queryFrame;
+
+    // Dynamic resolution: the scene goes to _sceneFbo at _resolutionScale of the viewport and is blitted up.
+    // The scale follows the averaged GPU frame time of frames drawn at the current scale.
+    bool _dynamicResolution;
+    float _targetFrameMs, _resolutionScale, _frameMsAverage;
+    int _frameMsSamples;
+    GLuint _sceneFbo, _sceneRb[2];                  // RGBA8 color, 24-bit depth
+    int _sceneWidth, _sceneHeight;
+    qint64 _sceneBytes;
 };
 
@@ -1,6 +1,7 @@
+#include <QDebug>
 #include "RedBookWidget.h"
 
-RedBookWidget::RedBookWidget(QWidget*) : _vertexBuffer(QOpenGLBuffer::VertexBuffer)
+RedBookWidget::RedBookWidget(QWidget*) : G(0), _benchmark(0)
 {
 }
 
@@ -12,19 +13,22 @@ RedBookWidget::~RedBookWidget()
 void RedBookWidget::initializeGL()
 {
     connect(context(), &QOpenGLContext::aboutToBeDestroyed, this, &RedBookWidget::cleanup);
-    initializeOpenGLFunctions();
-    glClearColor(0, 0, 0, 1);
-
-    setupGeometry();
-    setupProgram();
+    G = context()->versionFunctions<QOpenGLFunctions_3_3_Core>();
+    G->initializeOpenGLFunctions();
+    G->glClearColor(0, 0, 0, 1);
 }
 
 void RedBookWidget::paintGL()
 {
-    glClear(GL_COLOR_BUFFER_BIT);
-    QOpenGLVertexArrayObject::Binder binder(&_vertexArray);
-    glDrawArrays(GL_TRIANGLES, 0, 6);
-    glFlush();
+    G->glClear(GL_COLOR_BUFFER_BIT);
+    if (!_benchmark)
+        return;
+
+    G->glBindFramebuffer(GL_READ_FRAMEBUFFER, _benchmark->framebuffer());
+    G->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, defaultFramebufferObject());
+    G->glBlitFramebuffer(0, 0, _config.width, _config.height, 0, 0, width(), height(),
+        GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    G->glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
 }
 
 void RedBookWidget::resizeGL(int, int)
@@ -34,44 +38,26 @@ void RedBookWidget::resizeGL(int, int)
 
 void RedBookWidget::cleanup()
 {
+    if (!_benchmark)
+        return;
     makeCurrent();
-    _vertexArray.destroy();
-    _vertexBuffer.destroy();
-    _shaderProgram.release();
-}
-
-void RedBookWidget::setupGeometry()
-{
-    static const GLfloat vertexData[] =
-    {
-        -0.90, -0.90,
-         0.85, -0.90,
-        -0.90,  0.85,
-         0.90, -0.85,
-         0.90,  0.90,
-        -0.85,  0.90
-    };
-
-    _vertexArray.create();
-    QOpenGLVertexArrayObject::Binder binder(&_vertexArray);
-
-    _vertexBuffer.create();
-    _vertexBuffer.bind();
-    _vertexBuffer.setUsagePattern(QOpenGLBuffer::StaticDraw);
-    _vertexBuffer.allocate(vertexData, sizeof(vertexData));
-
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
-    glEnableVertexAttribArray(0);
+    delete _benchmark;
+    _benchmark = 0;
+    doneCurrent();
 }
 
-void RedBookWidget::setupProgram()
+// Blocks until every path has been measured.
+void RedBookWidget::runBenchmark()
 {
-    if (!_shaderProgram.addShaderFromSourceFile(QOpenGLShader::Vertex, "Shaders/VertexTest.txt"))
-        qDebug() << "VERTEX SHADER LOG: " << _shaderProgram.log();
+    QString log;
 
-    if (!_shaderProgram.addShaderFromSourceFile(QOpenGLShader::Fragment, "Shaders/FragmentTest.txt"))
-        qDebug() << "FRAGMENT SHADER LOG: " << _shaderProgram.log();
-
-    _shaderProgram.link();
-    _shaderProgram.bind();
+    makeCurrent();
+    delete _benchmark;
+    _benchmark = new DrawBenchmark(G);
+    if (_benchmark->initialize(_config, log))
+        log += DrawBenchmark::table(_config, _benchmark->runAll());
+    doneCurrent();
+
+    emit benchmarkFinished(log);
+    update();
 }
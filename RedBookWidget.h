@@ -1,18 +1,15 @@
-// The very first example from the red book, adapted to QT.
+// The very first example from the red book, adapted to QT.  Now hosts DrawBenchmark: runs it on demand
+// and shows the last frame it drew.
 
 #pragma once
 #ifndef REDBOOK_WIDGET_H
 #define REDBOOK_WIDGET_H
 
 #include <QOpenGLWidget>
-#include <QOpenGLFunctions>
-#include <QOpenGLVertexArrayObject>
-#include <QOpenGLBuffer>
-#include <QOpenGLShaderProgram>
+#include <QOpenGLFunctions_3_3_Core>
+#include "DrawBenchmark.h"
 
-QT_FORWARD_DECLARE_CLASS(QOpenGLShaderProgram)
-
-class RedBookWidget : public QOpenGLWidget, protected QOpenGLFunctions
+class RedBookWidget : public QOpenGLWidget
 {
     Q_OBJECT
 
@@ -23,19 +20,25 @@ public:
     QSize minimumSizeHint() const override { return QSize(320, 200); }
     QSize sizeHint() const override { return QSize(800, 600); }
 
+    void setConfig(const DrawBenchmark::Config &config) { _config = config; }
+
+public slots:
+    void runBenchmark();
+
+signals:
+    void benchmarkFinished(const QString &table);
+
 protected:
     void initializeGL() override;
     void paintGL() override;
     void resizeGL(int width, int height) override;
 
 private:
-    void setupGeometry();
-    void setupProgram();
     void cleanup();
 
-    QOpenGLVertexArrayObject _vertexArray;
-    QOpenGLBuffer _vertexBuffer;
-    QOpenGLShaderProgram _shaderProgram;
+    QOpenGLFunctions_3_3_Core *G;
+    DrawBenchmark *_benchmark;
+    DrawBenchmark::Config _config;
 };
 
 #endif
\ No newline at end of file
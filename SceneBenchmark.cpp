@@ -0,0 +1,224 @@
+#include <math.h>
+#include <string.h>
+#include <QImage>
+#include <QMatrix4x4>
+#include "SceneBenchmark.h"
+#include "SurfaceGenerator.h"
+
+static const int WarmupFrames = 3;
+
+SceneBenchmark::SceneBenchmark(QOpenGLFunctions_3_3_Core *gl) :
+    G(gl),
+    _fbo(0), _colorRb(0), _depthRb(0),
+    _vao(0), _tex(0), _vertexCount(0),
+    _timeQuery(0), _samplesQuery(0),
+    _bufferCharge(MemoryStats::GpuBuffers), _textureCharge(MemoryStats::GpuTextures)
+{
+    _vbo[0] = _vbo[1] = _vbo[2] = _vbo[3] = 0;
+}
+
+SceneBenchmark::~SceneBenchmark()
+{
+    _renderer.cleanup();
+    G->glDeleteBuffers(4, _vbo);
+    G->glDeleteVertexArrays(1, &_vao);
+    G->glDeleteTextures(1, &_tex);
+    G->glDeleteFramebuffers(1, &_fbo);
+    G->glDeleteRenderbuffers(1, &_colorRb);
+    G->glDeleteRenderbuffers(1, &_depthRb);
+    G->glDeleteQueries(1, &_timeQuery);
+    G->glDeleteQueries(1, &_samplesQuery);
+    _bufferCharge.set(0);
+    _textureCharge.set(0);
+}
+
+bool SceneBenchmark::checkFramebuffer(const char *name, QString &log)
+{
+    if (G->glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE)
+        return true;
+    log += QString("%1 FRAMEBUFFER INCOMPLETE\n").arg(name);
+    return false;
+}
+
+bool SceneBenchmark::initialize(const Config &config, QString &log)
+{
+    _config = config;
+
+    _renderer.initialize(G);
+    const QString messages = _renderer.loadPrograms();
+    if (!_renderer.isLinked()) {
+        log += messages;
+        return false;
+    }
+
+    // Color and depth like the widget's framebuffer.
+    G->glGenFramebuffers(1, &_fbo);
+    G->glGenRenderbuffers(1, &_colorRb);
+    G->glGenRenderbuffers(1, &_depthRb);
+    G->glBindRenderbuffer(GL_RENDERBUFFER, _colorRb);
+    G->glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, _config.width, _config.height);
+    G->glBindRenderbuffer(GL_RENDERBUFFER, _depthRb);
+    G->glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, _config.width, _config.height);
+    G->glBindFramebuffer(GL_FRAMEBUFFER, _fbo);
+    G->glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, _colorRb);
+    G->glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, _depthRb);
+    if (!checkFramebuffer("BENCHMARK", log))
+        return false;
+
+    G->glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    _textureCharge.set((qint64)_config.width * _config.height * (4 + 4));
+
+    G->glGenQueries(1, &_timeQuery);
+    G->glGenQueries(1, &_samplesQuery);
+    G->glGenVertexArrays(1, &_vao);
+
+    setupGeometry();
+    setupInstances();
+    setupTexture();
+    setupCamera();
+    return true;
+}
+
+void SceneBenchmark::setupGeometry()
+{
+    ProjectiveGenerator generator;
+    generator.generate(_config.segmentCount, _config.segmentCount, true, true);
+
+    const auto &triangles = generator.getTriangles();
+    const auto &normals = generator.getNormals();
+    const auto &uvs = generator.getUVs();
+    const qint64 bytes[3] = {
+        (qint64)(triangles.size() * sizeof(QVector3D)), (qint64)(normals.size() * sizeof(QVector3D)),
+        (qint64)(uvs.size() * sizeof(QVector2D))
+    };
+    const void *data[3] = { &triangles[0], &normals[0], &uvs[0] };
+    const int sizes[3] = { 3, 3, 2 };
+
+    _vertexCount = (int)triangles.size();
+    G->glGenBuffers(4, _vbo);
+    G->glBindVertexArray(_vao);
+    for (int i = 0; i < 3; ++i) {
+        G->glBindBuffer(GL_ARRAY_BUFFER, _vbo[i]);
+        G->glBufferData(GL_ARRAY_BUFFER, bytes[i], data[i], GL_STATIC_DRAW);
+        G->glVertexAttribPointer(SceneRenderer::PositionAttribute + i, sizes[i], GL_FLOAT, GL_FALSE, 0, (void*)0);
+        G->glEnableVertexAttribArray(SceneRenderer::PositionAttribute + i);
+        _bufferCharge.set(_bufferCharge.bytes() + bytes[i]);
+    }
+    G->glBindVertexArray(0);
+    G->glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void SceneBenchmark::setupInstances()
+{
+    _bufferCharge.set(_bufferCharge.bytes() + _renderer.setupInstances(_vao, _vbo[3], _config.instanceCount));
+}
+
+// The widget's texture if it can be found, otherwise a checkerboard of the same kind.
+void SceneBenchmark::setupTexture()
+{
+    QImage img("Shaders/TextureBW.png", "PNG");
+    if (img.isNull()) {
+        img = QImage(64, 64, QImage::Format_RGBA8888);
+        for (int y = 0; y < img.height(); ++y)
+        for (int x = 0; x < img.width(); ++x)
+            img.setPixel(x, y, ((x / 8 + y / 8) & 1) ? 0xffffffff : 0xff000000);
+    }
+    img = img.convertToFormat(QImage::Format_RGBA8888);
+
+    G->glGenTextures(1, &_tex);
+    G->glBindTexture(GL_TEXTURE_2D, _tex);
+    G->glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    G->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    G->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    G->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, img.width(), img.height(), 0, GL_RGBA, GL_UNSIGNED_BYTE,
+        img.constBits());
+    G->glBindTexture(GL_TEXTURE_2D, 0);
+    _textureCharge.set(_textureCharge.bytes() + (qint64)img.width() * img.height() * 4);
+}
+
+// Look at the middle of the instance grid from above one edge, so that rows of surfaces cover each other.
+void SceneBenchmark::setupCamera()
+{
+    const float spacing = SceneRenderer::InstanceSpacing;
+    const int side = (int)ceilf(sqrtf((float)_config.instanceCount));
+    const float extent = spacing * side;
+    const QVector3D center(spacing * (side - 1) / 2, spacing * (side - 1) / 2, 0);
+    QMatrix4x4 vmp;
+
+    vmp.perspective(45, (float)_config.width / _config.height, 0.1f, 10 * extent + 100);
+    vmp.lookAt(center + QVector3D(0, -0.8f * extent - 4, 0.5f * extent + 3), center, QVector3D(0, 0, 1));
+    memcpy(_vmp, vmp.constData(), sizeof(_vmp));
+}
+
+// One frame as ProjectiveWidget::paintGL() draws it in the given mode, less the upscale.  samplesQuery, if not
+// 0, counts the shading pass only.
+void SceneBenchmark::drawFrame(SceneRenderer::Mode mode, GLuint samplesQuery)
+{
+    SceneRenderer::Frame frame;
+    frame.target = _fbo;
+    frame.width = _config.width;
+    frame.height = _config.height;
+    frame.vao = _vao;
+    frame.tex = _tex;
+    frame.vertexCount = _vertexCount;
+    frame.instanceCount = _config.instanceCount;
+    frame.vmp = _vmp;
+    frame.samplesQuery = samplesQuery;
+    _renderer.draw(mode, frame);
+}
+
+SceneBenchmark::Result SceneBenchmark::run(const char *name, SceneRenderer::Mode mode)
+{
+    GLuint64 gpuNs = 0;
+    GLuint samples = 0;
+
+    G->glViewport(0, 0, _config.width, _config.height);
+    G->glClearColor(0, 0, 0, 1);
+
+    for (int f = 0; f < WarmupFrames; ++f)
+        drawFrame(mode, 0);
+
+    // Overdraw from one frame; it's the same every frame.
+    drawFrame(mode, _samplesQuery);
+    G->glFinish();
+
+    G->glBeginQuery(GL_TIME_ELAPSED, _timeQuery);
+    for (int f = 0; f < _config.frames; ++f)
+        drawFrame(mode, 0);
+    G->glEndQuery(GL_TIME_ELAPSED);
+    G->glFinish();
+
+    G->glGetQueryObjectui64v(_timeQuery, GL_QUERY_RESULT, &gpuNs);
+    G->glGetQueryObjectuiv(_samplesQuery, GL_QUERY_RESULT, &samples);
+    G->glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    Result r;
+    r.name = name;
+    r.gpuMs = gpuNs / 1e6 / _config.frames;
+    r.overdraw = (double)samples / ((qint64)_config.width * _config.height);
+    return r;
+}
+
+std::vector<SceneBenchmark::Result> SceneBenchmark::runAll()
+{
+    std::vector<Result> results;
+
+    results.push_back(run("blend, no depth", SceneRenderer::BlendMode));
+    results.push_back(run("opaque", SceneRenderer::OpaqueMode));
+    results.push_back(run("opaque, depth pre-pass", SceneRenderer::PrepassMode));
+    results.push_back(run("weighted blended OIT", SceneRenderer::OITMode));
+    return results;
+}
+
+QString SceneBenchmark::table(const Config &config, const std::vector<Result> &results)
+{
+    QString t = QString("%1 instances x %2 triangles = %3 triangles/frame, %4 frames, %5x%6\n")
+        .arg(config.instanceCount).arg(2 * config.segmentCount * config.segmentCount)
+        .arg(2LL * config.instanceCount * config.segmentCount * config.segmentCount)
+        .arg(config.frames).arg(config.width).arg(config.height);
+
+    t += QString("%1 %2 %3\n").arg("render mode", -36).arg("gpu ms", 9).arg("overdraw", 9);
+    for (const auto &r : results)
+        t += QString("%1 %2 %3\n").arg(r.name, -36).arg(r.gpuMs, 9, 'f', 3).arg(r.overdraw, 9, 'f', 2);
+    return t;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+#include <QString>
+#include <QOpenGLFunctions_3_3_Core>
+#include "MemoryStats.h"
+#include "SceneRenderer.h"
+
+// Offscreen comparison of ProjectiveWidget's render modes on the same scene: instanceCount surfaces of
+// segmentCount segments on the widget's instance grid, seen at a slant so that they overlap.  Draws through the
+// widget's SceneRenderer.  Reports GPU time per frame and the samples that passed the shading pass per pixel
+// (overdraw).
+// Needs a current 3.3 core context for its whole lifetime, but no window.
+class SceneBenchmark
+{
+public:
+    struct Config
+    {
+        int segmentCount, instanceCount, frames;
+        int width, height;
+
+        Config() : segmentCount(128), instanceCount(64), frames(100), width(512), height(512) { }
+    };
+
+    struct Result
+    {
+        QString name;
+        double gpuMs;           // GL_TIME_ELAPSED, per frame
+        double overdraw;        // GL_SAMPLES_PASSED of the shading pass per pixel
+    };
+
+    explicit SceneBenchmark(QOpenGLFunctions_3_3_Core *gl);
+    ~SceneBenchmark();
+
+    bool initialize(const Config &config, QString &log);
+    std::vector<Result> runAll();
+
+    static QString table(const Config &config, const std::vector<Result> &results);
+
+private:
+    Result run(const char *name, SceneRenderer::Mode mode);
+    void drawFrame(SceneRenderer::Mode mode, GLuint samplesQuery);
+
+    bool checkFramebuffer(const char *name, QString &log);
+    void setupGeometry();
+    void setupInstances();
+    void setupTexture();
+    void setupCamera();
+
+    QOpenGLFunctions_3_3_Core *G;
+    Config _config;
+    SceneRenderer _renderer;
+    float _vmp[16];
+
+    GLuint _fbo, _colorRb, _depthRb;
+    GLuint _vao, _vbo[4], _tex;
+    int _vertexCount;
+
+    GLuint _timeQuery, _samplesQuery;
+    MemoryCharge _bufferCharge, _textureCharge;
+};
@@ -0,0 +1,297 @@
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+#include <random>
+#include <vector>
+#include <QMatrix4x4>
+#include <QDebug>
+#include "SceneRenderer.h"
+
+const float SceneRenderer::InstanceSpacing = 5;
+
+SceneRenderer::SceneRenderer() :
+    G(0),
+    _vmp_i(-1), _tex_i(-1), _alpha_i(-1), _oit_i(-1), _depth_vmp_i(-1), _accum_tex_i(-1), _weight_tex_i(-1),
+    _emptyVao(0), _oitFbo(0), _oitWidth(0), _oitHeight(0),
+    _oitCharge(MemoryStats::GpuTextures)
+{
+    _oitTex[0] = _oitTex[1] = 0;
+}
+
+void SceneRenderer::initialize(QOpenGLFunctions_3_3_Core *gl)
+{
+    G = gl;
+    G->glGenVertexArrays(1, &_emptyVao);
+}
+
+void SceneRenderer::cleanup()
+{
+    if (!G)
+        return;
+    deleteOITTargets();
+    G->glDeleteVertexArrays(1, &_emptyVao);
+    _emptyVao = 0;
+    _program.release();
+}
+
+QString SceneRenderer::loadPrograms()
+{
+    QString compileMessages;
+
+    _program.removeAllShaders();
+
+    compileMessages = "VERTEX SHADER LOG:\n";
+    if (!_program.addShaderFromSourceFile(QOpenGLShader::Vertex, "Shaders/Perspective.txt"))
+        compileMessages += _program.log() + "\n";
+
+    compileMessages += "FRAGMENT SHADER LOG:\n";
+    if (!_program.addShaderFromSourceFile(QOpenGLShader::Fragment, "Shaders/Fragment.txt"))
+        compileMessages += _program.log() + "\n";
+
+    compileMessages += "LINK LOG:\n";
+    if (!_program.link())
+        compileMessages += _program.log() + "\n";
+
+    GLuint p = _program.programId();
+
+    // WTF? glGetAttribLocation will return -1 for vertex_normal unless it is somehow used in the program.
+    // So the attribute locations are fixed (see Attribute) rather than queried.
+    if (G->glGetAttribLocation(p, "vertex_normal") < 0)
+      compileMessages += "VERTEX NORMAL OPTIMIZED OUT\n";
+
+    _vmp_i = G->glGetUniformLocation(p, "vmp");
+    _tex_i = G->glGetUniformLocation(p, "tex");
+    _alpha_i = G->glGetUniformLocation(p, "alpha");
+    _oit_i = G->glGetUniformLocation(p, "oit");
+
+    compileMessages += loadProgram(_depthProgram, "DEPTH PRE-PASS",
+        "Shaders/Perspective.txt", "Shaders/DepthOnly.txt");
+    _depth_vmp_i = G->glGetUniformLocation(_depthProgram.programId(), "vmp");
+
+    compileMessages += loadProgram(_compositeProgram, "OIT COMPOSITE",
+        "Shaders/Fullscreen.txt", "Shaders/OITComposite.txt");
+    _accum_tex_i = G->glGetUniformLocation(_compositeProgram.programId(), "accum_tex");
+    _weight_tex_i = G->glGetUniformLocation(_compositeProgram.programId(), "weight_tex");
+
+    _program.bind();
+    return compileMessages;
+}
+
+bool SceneRenderer::isLinked() const
+{
+    return _program.isLinked() && _depthProgram.isLinked() && _compositeProgram.isLinked();
+}
+
+// Returns the messages, if any.
+QString SceneRenderer::loadProgram(QOpenGLShaderProgram &program, const char *name,
+    const char *vertexFile, const char *fragmentFile)
+{
+    QString messages;
+
+    program.removeAllShaders();
+    if (!program.addShaderFromSourceFile(QOpenGLShader::Vertex, vertexFile))
+        messages += QString("%1 VERTEX SHADER LOG:\n%2\n").arg(name).arg(program.log());
+    if (!program.addShaderFromSourceFile(QOpenGLShader::Fragment, fragmentFile))
+        messages += QString("%1 FRAGMENT SHADER LOG:\n%2\n").arg(name).arg(program.log());
+    if (!program.link())
+        messages += QString("%1 LINK LOG:\n%2\n").arg(name).arg(program.log());
+    return messages;
+}
+
+// Instance 0 is the untransformed surface; the rest are rotated copies with their own parameter and tint.
+// The seed is fixed, so a given count always gives the same scene.
+qint64 SceneRenderer::setupInstances(GLuint vao, GLuint vbo, int instanceCount)
+{
+    const int side = (int)ceilf(sqrtf((float)instanceCount));
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> angle(0, 360), param(0.3f, 0.7f), tint(0.5f, 1);
+    std::vector<InstanceData> instances(instanceCount);
+
+    for (int i = 0; i < instanceCount; ++i)
+    {
+        InstanceData &d = instances[i];
+        QMatrix4x4 model;
+
+        if (i == 0) {
+            d.param = 0.5f;
+            d.color[0] = d.color[1] = d.color[2] = 1;
+        } else {
+            model.translate(InstanceSpacing * (i % side), InstanceSpacing * (i / side), 0);
+            model.rotate(angle(rng), 0, 0, 1);
+            d.param = param(rng);
+            d.color[0] = tint(rng); d.color[1] = tint(rng); d.color[2] = tint(rng);
+        }
+        d.color[3] = 1;
+        memcpy(d.model, model.constData(), sizeof(d.model));
+    }
+
+    const qint64 bytes = (qint64)instances.size() * sizeof(InstanceData);
+    G->glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    G->glBufferData(GL_ARRAY_BUFFER, bytes, &instances[0], GL_STATIC_DRAW);
+
+    G->glBindVertexArray(vao);
+    for (int c = 0; c < 4; ++c) {
+        G->glVertexAttribPointer(InstanceModelAttribute + c, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+            (void*)(offsetof(InstanceData, model) + 4 * c * sizeof(float)));
+        G->glVertexAttribDivisor(InstanceModelAttribute + c, 1);
+        G->glEnableVertexAttribArray(InstanceModelAttribute + c);
+    }
+    G->glVertexAttribPointer(InstanceParamAttribute, 1, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+        (void*)offsetof(InstanceData, param));
+    G->glVertexAttribDivisor(InstanceParamAttribute, 1);
+    G->glEnableVertexAttribArray(InstanceParamAttribute);
+    G->glVertexAttribPointer(InstanceColorAttribute, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+        (void*)offsetof(InstanceData, color));
+    G->glVertexAttribDivisor(InstanceColorAttribute, 1);
+    G->glEnableVertexAttribArray(InstanceColorAttribute);
+    G->glBindVertexArray(0);
+    G->glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return bytes;
+}
+
+// Clear frame.target and draw the scene into it in the given mode.
+void SceneRenderer::draw(Mode mode, const Frame &frame)
+{
+    if (mode == OITMode)
+        setupOITTargets(frame.width, frame.height);
+
+    G->glBindFramebuffer(GL_FRAMEBUFFER, frame.target);
+    G->glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    G->glBindVertexArray(frame.vao);
+    G->glActiveTexture(GL_TEXTURE0);
+    G->glBindTexture(GL_TEXTURE_2D, frame.tex);
+
+    switch (mode)
+    {
+    case BlendMode:
+        G->glDisable(GL_DEPTH_TEST);
+        G->glEnable(GL_BLEND);
+        G->glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        drawSurface(frame, 1, false);
+        break;
+
+    case OpaqueMode:
+        G->glEnable(GL_DEPTH_TEST);
+        G->glDepthFunc(GL_LESS);
+        G->glDisable(GL_BLEND);
+        drawSurface(frame, 1, false);
+        break;
+
+    // Lay down depth with a trivial fragment shader, then shade only the visible fragments (early-Z rejects the
+    // rest).  Depth writes must be back on before the next frame's clear.
+    case PrepassMode:
+        G->glEnable(GL_DEPTH_TEST);
+        G->glDepthFunc(GL_LESS);
+        G->glDisable(GL_BLEND);
+        G->glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        _depthProgram.bind();
+        G->glUniformMatrix4fv(_depth_vmp_i, 1, GL_FALSE, frame.vmp);
+        G->glDrawArraysInstanced(GL_TRIANGLES, 0, frame.vertexCount, frame.instanceCount);
+        G->glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        G->glDepthFunc(GL_LEQUAL);
+        G->glDepthMask(GL_FALSE);
+        drawSurface(frame, 1, false);
+        G->glDepthMask(GL_TRUE);
+        break;
+
+    case OITMode:
+        drawWeightedOIT(frame);
+        break;
+    }
+
+    G->glBindVertexArray(0);
+}
+
+// One instanced draw of the whole scene with the main program; the samples-passed query around it counts
+// shaded fragments, i.e., overdraw.
+void SceneRenderer::drawSurface(const Frame &frame, float alpha, bool oit)
+{
+    _program.bind();
+    G->glUniformMatrix4fv(_vmp_i, 1, GL_FALSE, frame.vmp);
+    G->glUniform1i(_tex_i, 0);
+    G->glUniform1f(_alpha_i, alpha);
+    G->glUniform1i(_oit_i, oit);
+
+    if (frame.samplesQuery)
+        G->glBeginQuery(GL_SAMPLES_PASSED, frame.samplesQuery);
+#if 1
+    G->glDrawArraysInstanced(GL_TRIANGLES, 0, frame.vertexCount, frame.instanceCount);
+#else
+    for (int i = 0; i < frame.vertexCount / 3; ++i)
+        G->glDrawArrays(GL_LINE_LOOP, 3*i, 3);
+#endif
+    if (frame.samplesQuery)
+        G->glEndQuery(GL_SAMPLES_PASSED);
+}
+
+// Weighted-blended order-independent transparency in one geometry pass.  Core 3.3 has no per-target blend
+// functions, so both targets share one: the accumulation target sums premultiplied weighted color in rgb
+// (ONE, ONE) and multiplies revealage into alpha (ZERO, ONE_MINUS_SRC_ALPHA); the single-channel weight target
+// only has rgb, so it just sums.
+void SceneRenderer::drawWeightedOIT(const Frame &frame)
+{
+    static const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    static const GLfloat accumClear[] = { 0, 0, 0, 1 }, weightClear[] = { 0, 0, 0, 0 };
+
+    G->glBindFramebuffer(GL_FRAMEBUFFER, _oitFbo);
+    G->glDrawBuffers(2, drawBuffers);
+    G->glClearBufferfv(GL_COLOR, 0, accumClear);
+    G->glClearBufferfv(GL_COLOR, 1, weightClear);
+    G->glDisable(GL_DEPTH_TEST);
+    G->glEnable(GL_BLEND);
+    G->glBlendFuncSeparate(GL_ONE, GL_ONE, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+    drawSurface(frame, 0.5f, true);
+
+    G->glBindFramebuffer(GL_FRAMEBUFFER, frame.target);
+    G->glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    _compositeProgram.bind();
+    G->glActiveTexture(GL_TEXTURE1);
+    G->glBindTexture(GL_TEXTURE_2D, _oitTex[0]);
+    G->glActiveTexture(GL_TEXTURE2);
+    G->glBindTexture(GL_TEXTURE_2D, _oitTex[1]);
+    G->glActiveTexture(GL_TEXTURE0);
+    G->glUniform1i(_accum_tex_i, 1);
+    G->glUniform1i(_weight_tex_i, 2);
+    G->glBindVertexArray(_emptyVao);
+    G->glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+// (Re)create the OIT targets when the render size changed.
+void SceneRenderer::setupOITTargets(int width, int height)
+{
+    if (_oitFbo && _oitWidth == width && _oitHeight == height)
+        return;
+
+    deleteOITTargets();
+    _oitWidth = width;
+    _oitHeight = height;
+
+    G->glGenFramebuffers(1, &_oitFbo);
+    G->glGenTextures(2, _oitTex);
+
+    const GLenum formats[2] = { GL_RGBA16F, GL_R16F };
+    for (int i = 0; i < 2; ++i) {
+        G->glBindTexture(GL_TEXTURE_2D, _oitTex[i]);
+        G->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        G->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        G->glTexImage2D(GL_TEXTURE_2D, 0, formats[i], _oitWidth, _oitHeight, 0, GL_RGBA, GL_FLOAT, 0);
+    }
+    G->glBindTexture(GL_TEXTURE_2D, 0);
+
+    G->glBindFramebuffer(GL_FRAMEBUFFER, _oitFbo);
+    G->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, _oitTex[0], 0);
+    G->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, _oitTex[1], 0);
+    if (G->glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        qDebug() << "OIT FRAMEBUFFER INCOMPLETE";
+
+    _oitCharge.set((qint64)_oitWidth * _oitHeight * (8 + 2));
+}
+
+void SceneRenderer::deleteOITTargets()
+{
+    G->glDeleteFramebuffers(1, &_oitFbo);
+    G->glDeleteTextures(2, _oitTex);
+    _oitFbo = _oitTex[0] = _oitTex[1] = 0;
+    _oitWidth = _oitHeight = 0;
+    _oitCharge.set(0);
+}
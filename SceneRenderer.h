@@ -0,0 +1,71 @@
+#pragma once
+
+#include <QString>
+#include <QOpenGLFunctions_3_3_Core>
+#include <QOpenGLShaderProgram>
+#include "MemoryStats.h"
+
+// The scene's instance layout and the passes of each render mode, with the programs and OIT targets they need.
+// ProjectiveWidget draws with it and SceneBenchmark measures it.  Everything but the constructor needs the
+// context initialize() was called in.
+class SceneRenderer
+{
+public:
+    enum Mode { BlendMode, OpaqueMode, PrepassMode, OITMode };
+
+    // Vertex data is bound by the caller, per-instance data by setupInstances().
+    enum Attribute { PositionAttribute, NormalAttribute, UVAttribute, InstanceModelAttribute,
+        InstanceParamAttribute = InstanceModelAttribute + 4, InstanceColorAttribute };
+
+    static const float InstanceSpacing;     // grid units between neighbouring instances
+
+    // One frame: where it goes (the viewport must already cover width x height of target) and what it draws.
+    struct Frame
+    {
+        GLuint target;
+        int width, height;
+        GLuint vao, tex;                    // vao has the vertex attributes and the instance layout
+        int vertexCount, instanceCount;
+        const float *vmp;
+        GLuint samplesQuery;                // if not 0, counts the samples of the shading pass
+    };
+
+    SceneRenderer();
+
+    void initialize(QOpenGLFunctions_3_3_Core *gl);
+    void cleanup();
+
+    // Returns the compile and link messages; isLinked() tells whether drawing is possible.
+    QString loadPrograms();
+    bool isLinked() const;
+
+    // Fill vbo with instanceCount instances on a square grid and point vao's instance attributes at it.
+    // Returns the size of vbo.
+    qint64 setupInstances(GLuint vao, GLuint vbo, int instanceCount);
+
+    void draw(Mode mode, const Frame &frame);
+
+private:
+    struct InstanceData
+    {
+        float model[16];
+        float param;
+        float color[4];
+    };
+
+    void drawSurface(const Frame &frame, float alpha, bool oit);
+    void drawWeightedOIT(const Frame &frame);
+    void setupOITTargets(int width, int height);
+    void deleteOITTargets();
+    static QString loadProgram(QOpenGLShaderProgram &program, const char *name,
+        const char *vertexFile, const char *fragmentFile);
+
+    QOpenGLFunctions_3_3_Core *G;
+    QOpenGLShaderProgram _program, _depthProgram, _compositeProgram;
+    GLint _vmp_i, _tex_i, _alpha_i, _oit_i, _depth_vmp_i, _accum_tex_i, _weight_tex_i;
+
+    // Weighted-blended OIT targets: RGBA16F accumulation/revealage and R16F weight.
+    GLuint _emptyVao, _oitFbo, _oitTex[2];
+    int _oitWidth, _oitHeight;
+    MemoryCharge _oitCharge;
+};
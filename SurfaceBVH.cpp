@@ -0,0 +1,406 @@
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include "SurfaceBVH.h"
+
+static const int BinCount = 12;
+static const int MaxLeafSize = 4;
+static const int MaxSAHLeafSize = 16;          // SAH may decide to stop splitting below this size
+static const int ParallelThreshold = 1 << 15;   // subtrees smaller than this are built serially
+static const int MaxParallelDepth = 8;
+static const int StackSize = 128;
+
+void SurfaceBVH::Box::reset()
+{
+    lo[0] = lo[1] = lo[2] = FLT_MAX;
+    hi[0] = hi[1] = hi[2] = -FLT_MAX;
+}
+
+void SurfaceBVH::Box::grow(const QVector3D &p)
+{
+    for (int i = 0; i < 3; ++i) {
+        lo[i] = std::min(lo[i], p[i]);
+        hi[i] = std::max(hi[i], p[i]);
+    }
+}
+
+void SurfaceBVH::Box::grow(const Box &b)
+{
+    for (int i = 0; i < 3; ++i) {
+        lo[i] = std::min(lo[i], b.lo[i]);
+        hi[i] = std::max(hi[i], b.hi[i]);
+    }
+}
+
+float SurfaceBVH::Box::area() const
+{
+    float dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+    if (dx < 0 || dy < 0 || dz < 0)
+        return 0;
+    return 2 * (dx*dy + dy*dz + dz*dx);
+}
+
+struct SurfaceBVH::Builder
+{
+    SurfaceBVH &bvh;
+    std::atomic<int> nodeCount, maxDepth;
+
+    Builder(SurfaceBVH &bvh) : bvh(bvh)
+    {
+        nodeCount = 1;
+        maxDepth = 0;
+    }
+
+    void makeLeaf(Node &node, int first, int count)
+    {
+        node.first = first;
+        node.count = count;
+    }
+
+    void build(int ni, int first, int count, int depth);
+};
+
+// Nodes are preallocated, so concurrent subtrees write disjoint elements of _nodes and disjoint ranges
+// of _indices.  Children always get higher indices than their parent, which refit relies on.
+void SurfaceBVH::Builder::build(int ni, int first, int count, int depth)
+{
+    Node &node = bvh._nodes[ni];
+    int *indices = &bvh._indices[first];
+    Box centroidBox;
+
+    int deepest = maxDepth.load();
+    while (depth > deepest && !maxDepth.compare_exchange_weak(deepest, depth))
+        ;
+
+    node.box.reset();
+    centroidBox.reset();
+    for (int i = 0; i < count; ++i) {
+        node.box.grow(bvh._boxes[indices[i]]);
+        centroidBox.grow(bvh._centroids[indices[i]]);
+    }
+
+    if (count <= MaxLeafSize) {
+        makeLeaf(node, first, count);
+        return;
+    }
+
+    int axis = 0;
+    float extent[3];
+    for (int i = 0; i < 3; ++i)
+        extent[i] = centroidBox.hi[i] - centroidBox.lo[i];
+    if (extent[1] > extent[axis]) axis = 1;
+    if (extent[2] > extent[axis]) axis = 2;
+
+    // All centroids coincide; no split can separate them.
+    if (extent[axis] <= 0) {
+        makeLeaf(node, first, count);
+        return;
+    }
+
+    const float lo = centroidBox.lo[axis];
+    const float scale = BinCount / extent[axis];
+    auto binOf = [&](int t) {
+        int b = (int)((bvh._centroids[t][axis] - lo) * scale);
+        return std::min(b, BinCount - 1);
+    };
+
+    Box binBox[BinCount];
+    int binCount[BinCount] = { 0 };
+    for (int b = 0; b < BinCount; ++b)
+        binBox[b].reset();
+    for (int i = 0; i < count; ++i) {
+        int b = binOf(indices[i]);
+        binBox[b].grow(bvh._boxes[indices[i]]);
+        ++binCount[b];
+    }
+
+    // Sweep from the right to get the right-hand side areas, then from the left evaluating SAH for
+    // a split after each bin.
+    float rightArea[BinCount];
+    int rightCount[BinCount];
+    {
+        Box acc; acc.reset();
+        int n = 0;
+        for (int b = BinCount - 1; b > 0; --b) {
+            acc.grow(binBox[b]);
+            n += binCount[b];
+            rightArea[b] = acc.area();
+            rightCount[b] = n;
+        }
+    }
+
+    int bestSplit = -1;
+    float bestCost = FLT_MAX;
+    {
+        Box acc; acc.reset();
+        int n = 0;
+        for (int b = 0; b < BinCount - 1; ++b) {
+            acc.grow(binBox[b]);
+            n += binCount[b];
+            if (n == 0 || rightCount[b+1] == 0)
+                continue;
+            float cost = acc.area() * n + rightArea[b+1] * rightCount[b+1];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestSplit = b;
+            }
+        }
+    }
+
+    int leftCount;
+    if (bestSplit >= 0) {
+        if (count <= MaxSAHLeafSize && bestCost >= node.box.area() * count) {
+            makeLeaf(node, first, count);
+            return;
+        }
+        int *mid = std::partition(indices, indices + count, [&](int t) { return binOf(t) <= bestSplit; });
+        leftCount = (int)(mid - indices);
+    } else {
+        leftCount = 0;
+    }
+
+    // Binning failed to separate anything (clustered centroids); fall back to a median split.
+    if (leftCount == 0 || leftCount == count) {
+        leftCount = count / 2;
+        std::nth_element(indices, indices + leftCount, indices + count, [&](int a, int b) {
+            return bvh._centroids[a][axis] < bvh._centroids[b][axis];
+        });
+    }
+
+    const int left = nodeCount.fetch_add(2);
+    node.first = left;
+    node.count = 0;
+
+    if (count >= ParallelThreshold && depth < MaxParallelDepth) {
+        auto f = std::async(std::launch::async, [=]() { build(left, first, leftCount, depth + 1); });
+        build(left + 1, first + leftCount, count - leftCount, depth + 1);
+        f.get();
+    } else {
+        build(left, first, leftCount, depth + 1);
+        build(left + 1, first + leftCount, count - leftCount, depth + 1);
+    }
+}
+
+void SurfaceBVH::build(const std::vector<QVector3D> &triangles)
+{
+    assert(triangles.size() % 3 == 0);
+    const int n = (int)triangles.size() / 3;
+
+    clear();
+    if (n == 0)
+        return;
+
+    _indices.resize(n);
+    _centroids.resize(n);
+    _boxes.resize(n);
+    for (int i = 0; i < n; ++i) {
+        _indices[i] = i;
+        _centroids[i] = (triangles[3*i] + triangles[3*i+1] + triangles[3*i+2]) / 3;
+        _boxes[i].reset();
+        _boxes[i].grow(triangles[3*i]);
+        _boxes[i].grow(triangles[3*i+1]);
+        _boxes[i].grow(triangles[3*i+2]);
+    }
+
+    // A binary tree with at least one triangle per leaf has at most 2n-1 nodes.
+    _nodes.resize(2 * n);
+    updateMemoryCharge();
+
+    Builder builder(*this);
+    builder.build(0, 0, n, 0);
+    _depth = builder.maxDepth;
+
+    _nodes.resize(builder.nodeCount);
+    _nodes.shrink_to_fit();
+    std::vector<QVector3D>().swap(_centroids);
+    std::vector<Box>().swap(_boxes);
+
+    // Links for the partial refit.
+    _leafOf.resize(n);
+    _parents.resize(_nodes.size());
+    _refitMark.assign(_nodes.size(), 0);
+    _refitEpoch = 0;
+    _parents[0] = -1;
+    for (int ni = 0; ni < (int)_nodes.size(); ++ni) {
+        const Node &node = _nodes[ni];
+        if (node.count > 0) {
+            for (int i = node.first; i < node.first + node.count; ++i)
+                _leafOf[_indices[i]] = ni;
+        } else {
+            _parents[node.first] = _parents[node.first+1] = ni;
+        }
+    }
+    updateMemoryCharge();
+}
+
+void SurfaceBVH::updateMemoryCharge()
+{
+    _charge.set((qint64)_nodes.capacity() * sizeof(Node)
+        + (qint64)(_indices.capacity() + _leafOf.capacity() + _parents.capacity()) * sizeof(int)
+        + (qint64)_refitMark.capacity() * sizeof(unsigned)
+        + (qint64)_centroids.capacity() * sizeof(QVector3D) + (qint64)_boxes.capacity() * sizeof(Box));
+}
+
+// Upper bound on what build() holds for the given triangle count: 2n nodes with their parent links and refit
+// marks, the index and leaf arrays, and the build-time centroids and boxes, counted as if all were alive at once.
+qint64 SurfaceBVH::estimateBytes(int triangleCount)
+{
+    const qint64 n = triangleCount;
+    const qint64 nodes = 2 * n * (sizeof(Node) + sizeof(int) + sizeof(unsigned));
+    const qint64 triangles = n * (2 * sizeof(int) + sizeof(QVector3D) + sizeof(Box));
+    return nodes + triangles;
+}
+
+// Recompute boxes for moved vertices without changing the topology of the tree.  Cheaper than build(), but
+// the tree degrades if vertices move far; rebuild when the triangle count changes.  Only the leaves holding
+// triangles [firstTriangle, firstTriangle+count) and their ancestors are refitted, so the cost goes with the
+// number of changed triangles rather than the size of the tree.  Children come after their
+// parent, so processing the collected nodes from the highest index down updates every child before its parent.
+void SurfaceBVH::refit(const std::vector<QVector3D> &triangles, int firstTriangle, int count)
+{
+    assert((int)triangles.size() == 3 * triangleCount());
+    assert(firstTriangle >= 0 && firstTriangle + count <= triangleCount());
+
+    // A node is collected once per call: marks from earlier calls have an older epoch, so nothing needs clearing.
+    if (++_refitEpoch == 0) {
+        std::fill(_refitMark.begin(), _refitMark.end(), 0);
+        _refitEpoch = 1;
+    }
+
+    std::vector<int> changed;
+    for (int t = firstTriangle; t < firstTriangle + count; ++t)
+        for (int ni = _leafOf[t]; ni >= 0 && _refitMark[ni] != _refitEpoch; ni = _parents[ni]) {
+            _refitMark[ni] = _refitEpoch;
+            changed.push_back(ni);
+        }
+    std::sort(changed.begin(), changed.end());
+
+    for (auto it = changed.rbegin(); it != changed.rend(); ++it) {
+        Node &node = _nodes[*it];
+        node.box.reset();
+        if (node.count > 0) {
+            for (int i = node.first; i < node.first + node.count; ++i) {
+                const int t = _indices[i];
+                node.box.grow(triangles[3*t]);
+                node.box.grow(triangles[3*t+1]);
+                node.box.grow(triangles[3*t+2]);
+            }
+        } else {
+            node.box.grow(_nodes[node.first].box);
+            node.box.grow(_nodes[node.first+1].box);
+        }
+    }
+}
+
+void SurfaceBVH::clear()
+{
+    _depth = 0;
+    std::vector<Node>().swap(_nodes);
+    std::vector<int>().swap(_indices);
+    std::vector<int>().swap(_leafOf);
+    std::vector<int>().swap(_parents);
+    std::vector<unsigned>().swap(_refitMark);
+    std::vector<QVector3D>().swap(_centroids);
+    std::vector<Box>().swap(_boxes);
+    updateMemoryCharge();
+}
+
+// Moller-Trumbore.
+bool SurfaceBVH::intersectTriangle(const QVector3D *v, const QVector3D &origin, const QVector3D &direction,
+    float &t, float &b1, float &b2)
+{
+    const float eps = 1e-9f;
+    QVector3D e1 = v[1] - v[0], e2 = v[2] - v[0];
+    QVector3D p = QVector3D::crossProduct(direction, e2);
+    float det = QVector3D::dotProduct(e1, p);
+    if (fabsf(det) < eps)
+        return false;
+
+    float inv = 1 / det;
+    QVector3D s = origin - v[0];
+    b1 = QVector3D::dotProduct(s, p) * inv;
+    if (b1 < 0 || b1 > 1)
+        return false;
+
+    QVector3D q = QVector3D::crossProduct(s, e1);
+    b2 = QVector3D::dotProduct(direction, q) * inv;
+    if (b2 < 0 || b1 + b2 > 1)
+        return false;
+
+    t = QVector3D::dotProduct(e2, q) * inv;
+    return t > 0;
+}
+
+bool SurfaceBVH::intersect(const std::vector<QVector3D> &triangles, const QVector3D &origin,
+    const QVector3D &direction, Hit &hit) const
+{
+    if (_nodes.empty())
+        return false;
+
+    const float o[3] = { origin.x(), origin.y(), origin.z() };
+    const float inv[3] = { 1 / direction.x(), 1 / direction.y(), 1 / direction.z() };
+
+    // Entry distance into the box, or FLT_MAX if missed or farther than the current hit.
+    auto enter = [&](const Box &b, float tmax) {
+        float t0 = 0, t1 = tmax;
+        for (int i = 0; i < 3; ++i) {
+            float ta = (b.lo[i] - o[i]) * inv[i], tb = (b.hi[i] - o[i]) * inv[i];
+            if (ta > tb) std::swap(ta, tb);
+            t0 = std::max(t0, ta);
+            t1 = std::min(t1, tb);
+        }
+        return t0 <= t1 ? t0 : FLT_MAX;
+    };
+
+    // Each level pops one node and pushes at most two, so depth+1 entries always suffice.  Degenerate input
+    // can give trees deeper than the usual stack; those get one sized on the heap.
+    int localStack[StackSize];
+    std::vector<int> heapStack;
+    int *stack = localStack;
+    if (_depth + 2 > StackSize) {
+        heapStack.resize(_depth + 2);
+        stack = &heapStack[0];
+    }
+    int sp = 0;
+    bool found = false;
+
+    hit.t = FLT_MAX;
+    if (enter(_nodes[0].box, hit.t) == FLT_MAX)
+        return false;
+    stack[sp++] = 0;
+
+    while (sp > 0) {
+        const Node &node = _nodes[stack[--sp]];
+
+        if (node.count > 0) {
+            for (int i = node.first; i < node.first + node.count; ++i) {
+                const int tri = _indices[i];
+                float t, b1, b2;
+                if (intersectTriangle(&triangles[3*tri], origin, direction, t, b1, b2) && t < hit.t) {
+                    hit.triangle = tri;
+                    hit.t = t;
+                    hit.b1 = b1;
+                    hit.b2 = b2;
+                    found = true;
+                }
+            }
+            continue;
+        }
+
+        // Push the far child first so that the near one is visited first and can shrink hit.t.
+        int c0 = node.first, c1 = node.first + 1;
+        float d0 = enter(_nodes[c0].box, hit.t), d1 = enter(_nodes[c1].box, hit.t);
+        if (d1 < d0) {
+            std::swap(c0, c1);
+            std::swap(d0, d1);
+        }
+        assert(sp + 2 <= std::max(StackSize, _depth + 2));
+        if (d1 != FLT_MAX) stack[sp++] = c1;
+        if (d0 != FLT_MAX) stack[sp++] = c0;
+    }
+
+    return found;
+}
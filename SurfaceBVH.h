@@ -0,0 +1,66 @@
+#pragma once
+
+#include <vector>
+#include <QVector3D>
+#include "MemoryStats.h"
+
+// Bounding volume hierarchy over a triangle soup laid out as by SurfaceGenerator, i.e., 3 consecutive
+// vertices per triangle.  Built top-down with binned SAH; large subtrees are built in parallel.
+class SurfaceBVH
+{
+public:
+    struct Hit
+    {
+        int triangle;
+        float t;            // distance along the ray, in units of direction
+        float b1, b2;       // barycentric weights of the 2nd and 3rd triangle vertex
+    };
+
+    SurfaceBVH() : _refitEpoch(0), _depth(0), _charge(MemoryStats::BVH) { }
+
+    static qint64 estimateBytes(int triangleCount);
+    void build(const std::vector<QVector3D> &triangles);
+    void refit(const std::vector<QVector3D> &triangles, int firstTriangle, int count);
+    void clear();
+    bool isEmpty() const { return _nodes.empty(); }
+    int triangleCount() const { return (int)_indices.size(); }
+
+    // Nearest hit with t > 0.  triangles must be the (possibly refitted) data the hierarchy was built over.
+    bool intersect(const std::vector<QVector3D> &triangles, const QVector3D &origin, const QVector3D &direction,
+        Hit &hit) const;
+
+private:
+    struct Box
+    {
+        float lo[3], hi[3];
+        void reset();
+        void grow(const QVector3D &p);
+        void grow(const Box &b);
+        float area() const;
+    };
+
+    // Leaf if count > 0, covering _indices[first, first+count).  Otherwise children are at first, first+1.
+    struct Node
+    {
+        Box box;
+        int first, count;
+    };
+
+    struct Builder;
+
+    std::vector<Node> _nodes;
+    std::vector<int> _indices;
+    std::vector<int> _leafOf;            // leaf node of each triangle
+    std::vector<int> _parents;           // parent of each node; -1 for the root
+    std::vector<unsigned> _refitMark;    // per node, the partial refit that last collected it
+    unsigned _refitEpoch;
+    int _depth;                          // of the deepest node; sizes the traversal stack
+    std::vector<QVector3D> _centroids;   // build-time only
+    std::vector<Box> _boxes;             // build-time only
+    MemoryCharge _charge;
+
+    void updateMemoryCharge();
+
+    static bool intersectTriangle(const QVector3D *v, const QVector3D &origin, const QVector3D &direction,
+        float &t, float &b1, float &b2);
+};
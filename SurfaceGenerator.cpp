@@ -1,6 +1,10 @@
 #include <assert.h>
+#include <math.h>
+#include <algorithm>
 #include "SurfaceGenerator.h"
 
+const int SurfaceGenerator::ChunkSize;        // std::min() binds it by reference
+
 // Return the packed buffer as a vector.
 void SurfaceGenerator::generate(int uSegments, int vSegments, bool closeU, bool closeV)
 {
@@ -13,27 +17,146 @@ void SurfaceGenerator::generate(int uSegments, int vSegments, bool closeU, bool
     _uvNormal.resize(_uSegments * _vSegments, QVector3D(0, 0, 0));
     _divideCount.resize(_uSegments * _vSegments, 0);
 
+    // Two triangles per quad, written in chunk order.  Drop the previous output first so that the old and the
+    // new one are never held at the same time (unless the old one is still shared).
+    const size_t vertexCount = 6 * (size_t)uQuads() * vQuads();
+    _triangles.reset(); _triangles = std::make_shared<std::vector<QVector3D>>(vertexCount);
+    _normals.reset(); _normals = std::make_shared<std::vector<QVector3D>>(vertexCount);
+    _uvs.reset(); _uvs = std::make_shared<std::vector<QVector2D>>(vertexCount);
+    resetChunks();
+    updateMemoryCharges();
+
     generateUVVertex();
     generateTrianglesAndUVs();
     generateFlatNormals();
 
     // Pack data into a single buffer.  We have 8 floats per triangle (position, normal, UV)
-    assert(_triangles.size() == _normals.size() && _triangles.size() == _uvs.size());
-    assert(_triangles.size() % 3 == 0);
+    assert(_triangles->size() == _normals->size() && _triangles->size() == _uvs->size());
+    assert(_triangles->size() % 3 == 0);
+
+
+    // Release, not just clear, the scratch data; it's as large as the grid.
+    if (_reuseVertices && isNested()) {
+        _prevVertex.swap(_uvVertex);
+        _prevUSegments = _uSegments;
+        _prevVSegments = _vSegments;
+    }
+    std::vector<QVector3D>().swap(_uvVertex);
+    std::vector<QVector3D>().swap(_uvNormal);
+    std::vector<short>().swap(_divideCount);
+    updateMemoryCharges();
+}
+
+void SurfaceGenerator::setReuseVertices(bool reuse)
+{
+    _reuseVertices = reuse;
+    if (!reuse) {
+        std::vector<QVector3D>().swap(_prevVertex);
+        _prevUSegments = _prevVSegments = 0;
+        updateMemoryCharges();
+    }
+}
 
+void SurfaceGenerator::adoptOutput(SurfaceGenerator &other)
+{
+    _uSegments = other._uSegments;
+    _vSegments = other._vSegments;
+    _closeU = other._closeU;
+    _closeV = other._closeV;
+    _evaluations = other._evaluations;
+    _triangles = std::move(other._triangles);
+    _normals = std::move(other._normals);
+    _uvs = std::move(other._uvs);
+    other._triangles = std::make_shared<std::vector<QVector3D>>();
+    other._normals = std::make_shared<std::vector<QVector3D>>();
+    other._uvs = std::make_shared<std::vector<QVector2D>>();
+    other._dirtyChunks.clear();
+    updateMemoryCharges();
+    other.updateMemoryCharges();
+
+    // The adopted output doesn't have our bumps.
+    resetChunks();
+    for (const auto &b : _bumps)
+        markBumpDirty(b);
+}
+
+void SurfaceGenerator::updateMemoryCharges()
+{
+    _scratchCharge.set(
+        (qint64)(_uvVertex.capacity() + _uvNormal.capacity() + _prevVertex.capacity()) * sizeof(QVector3D)
+        + (qint64)_divideCount.capacity() * sizeof(short));
+    _outputCharge.set((qint64)(_triangles->capacity() + _normals->capacity()) * sizeof(QVector3D)
+        + (qint64)_uvs->capacity() * sizeof(QVector2D));
+}
 
-    _uvVertex.clear();
-    _uvNormal.clear();
-    _divideCount.clear();
+// Peak bytes generate() will hold for a grid of the given size (closed in both directions, the worst case).
+qint64 SurfaceGenerator::estimateBytes(int uSegments, int vSegments)
+{
+    const qint64 vertices = (qint64)uSegments * vSegments;
+    const qint64 scratch = vertices * (2 * sizeof(QVector3D) + sizeof(short));
+    const qint64 output = 6 * vertices * (2 * sizeof(QVector3D) + sizeof(QVector2D));
+    return scratch + output;
+}
+
+// Quads are stored chunk by chunk: chunk rows (ChunkSize quad rows each, the last one possibly shorter) one
+// after the other, the chunks of a chunk row one after the other, and the quads of a chunk row-major.  So every
+// chunk is contiguous and its offset has a closed form.
+int SurfaceGenerator::quadIndex(int u, int v) const
+{
+    const int cu = u / ChunkSize, cv = v / ChunkSize;
+    const int w = std::min(ChunkSize, uQuads() - cu * ChunkSize);
+    const int h = std::min(ChunkSize, vQuads() - cv * ChunkSize);
+    return cu * ChunkSize * vQuads() + cv * ChunkSize * w + (u - cu * ChunkSize) * h + (v - cv * ChunkSize);
+}
+
+// Inverse of quadIndex().
+void SurfaceGenerator::quadAt(int quad, int &u, int &v) const
+{
+    const int cu = quad / (ChunkSize * vQuads());
+    int r = quad - cu * ChunkSize * vQuads();
+    const int w = std::min(ChunkSize, uQuads() - cu * ChunkSize);
+    const int cv = r / (w * ChunkSize);
+    r -= cv * w * ChunkSize;
+    const int h = std::min(ChunkSize, vQuads() - cv * ChunkSize);
+    u = cu * ChunkSize + r / h;
+    v = cv * ChunkSize + r % h;
+}
+
+// Map a point given by barycentric weights on a generated triangle back to (fractional) grid coordinates.
+// Works on the grid rather than the output UVs, which wrap to 0 on the closing row/column.
+QVector2D SurfaceGenerator::triangleUV(int triangle, float b1, float b2) const
+{
+    const int h = triangle % 2;
+    int qu, qv;
+    quadAt(triangle / 2, qu, qv);
+    const float u = qu, v = qv;
+
+    if (h == 0)
+        return QVector2D(u + b1 + b2, v + b2);  // (u,v), (u1,v), (u1,v1)
+    return QVector2D(u + b1, v + b1 + b2);      // (u,v), (u1,v1), (u,v1)
 }
 
 void SurfaceGenerator::generateUVVertex()
 {
+    // Vertex (u, v) coincides with (u/su, v/sv) of the kept grid when both divide evenly.
+    int su = 0, sv = 0;
+    if (_reuseVertices && isNested() && _prevUSegments > 0 && _prevVSegments > 0
+        && _uSegments % _prevUSegments == 0 && _vSegments % _prevVSegments == 0)
+    {
+        su = _uSegments / _prevUSegments;
+        sv = _vSegments / _prevVSegments;
+    }
+
+    _evaluations = 0;
     for (int u = 0; u < _uSegments; ++u)
     for (int v = 0; v < _vSegments; ++v)
     {
-        auto uv = UV(u, v);
-        _uvVertex[VI(u, v)] = F(uv);
+        if (su && u % su == 0 && v % sv == 0) {
+            _uvVertex[VI(u, v)] = _prevVertex[(u / su) * _prevVSegments + v / sv];
+            continue;
+        }
+        _uvVertex[VI(u, v)] = vertex(u, v);
+        ++_evaluations;
     }
 }
 
@@ -82,19 +205,22 @@ void SurfaceGenerator::halfQuadVertex(int u, int v, int h)
     int i[4] = { VI(u, v), VI(u1, v), VI(u1, v1), VI(u, v1) };
     QVector3D c[3] = { _uvVertex[i[0]], _uvVertex[i[1+h]], _uvVertex[i[2+h]] };
     QVector3D n = QVector3D::normal(c[0], c[1], c[2]);
-    
-    _triangles.push_back(c[0]);
-    _triangles.push_back(c[1]);
-    _triangles.push_back(c[2]);
+    const int o = 6 * quadIndex(u, v) + 3 * h;
+    std::vector<QVector3D> &triangles = *_triangles;
+    std::vector<QVector2D> &uvs = *_uvs;
+
+    triangles[o] = c[0];
+    triangles[o+1] = c[1];
+    triangles[o+2] = c[2];
 
     if (h == 0) {
-        _uvs.push_back(UV(u, v));
-        _uvs.push_back(UV(u1, v));
-        _uvs.push_back(UV(u1, v1));
+        uvs[o] = UV(u, v);
+        uvs[o+1] = UV(u1, v);
+        uvs[o+2] = UV(u1, v1);
     } else {
-        _uvs.push_back(UV(u, v));
-        _uvs.push_back(UV(u1, v1));
-        _uvs.push_back(UV(u, v1));
+        uvs[o] = UV(u, v);
+        uvs[o+1] = UV(u1, v1);
+        uvs[o+2] = UV(u, v1);
     }
 
     _uvNormal[i[0]] += n;   ++_divideCount[i[0]];
@@ -107,10 +233,12 @@ void SurfaceGenerator::halfQuadSmoothNormal(int u, int v, int h)
     assert(h == 0 || h == 1);
     int u1 = (u + 1) % _uSegments, v1 = (v + 1) % _vSegments;
     int i[4] = { VI(u, v), VI(u1, v), VI(u1, v1), VI(u, v1) };
+    const int o = 6 * quadIndex(u, v) + 3 * h;
 
-    _normals.push_back(_uvNormal[i[0]]);
-    _normals.push_back(_uvNormal[i[1+h]]);
-    _normals.push_back(_uvNormal[i[2+h]]);
+    std::vector<QVector3D> &normals = *_normals;
+    normals[o] = _uvNormal[i[0]];
+    normals[o+1] = _uvNormal[i[1+h]];
+    normals[o+2] = _uvNormal[i[2+h]];
 }
 
 void SurfaceGenerator::halfQuadFlatNormal(int u, int v, int h)
@@ -120,8 +248,160 @@ void SurfaceGenerator::halfQuadFlatNormal(int u, int v, int h)
     int i[4] = { VI(u, v), VI(u1, v), VI(u1, v1), VI(u, v1) };
     QVector3D c[3] = { _uvVertex[i[0]], _uvVertex[i[1+h]], _uvVertex[i[2+h]] };
     QVector3D n = QVector3D::normal(c[0], c[1], c[2]);
+    const int o = 6 * quadIndex(u, v) + 3 * h;
+
+    std::vector<QVector3D> &normals = *_normals;
+    normals[o] = normals[o+1] = normals[o+2] = n;
+}
+
+// F at grid point (u, v), displaced by the bumps.  The normal for the displacement comes from finite
+// differences of F, so it's only evaluated for vertices that some bump actually reaches.
+QVector3D SurfaceGenerator::vertex(int u, int v) const
+{
+    const QVector2D uv = UV(u, v);
+    const QVector3D p = F(uv);
+    float offset = 0;
+
+    for (const auto &b : _bumps) {
+        QVector2D d = uv - b.uv;
+        if (_closeU) d.setX(d.x() - floorf(d.x() + 0.5f));
+        if (_closeV) d.setY(d.y() - floorf(d.y() + 0.5f));
+        const float r2 = d.lengthSquared() / (b.radius * b.radius);
+        if (r2 < 1)
+            offset += b.height * (1 - r2) * (1 - r2);
+    }
+    if (offset == 0)
+        return p;
+
+    const float eps = 1e-3f;
+    const QVector3D n = QVector3D::normal(F(uv + QVector2D(eps, 0)) - p, F(uv + QVector2D(0, eps)) - p);
+    return p + offset * n;
+}
 
-    _normals.push_back(n);
-    _normals.push_back(n);
-    _normals.push_back(n);
+void SurfaceGenerator::resetChunks()
+{
+    _uChunks = (uQuads() + ChunkSize - 1) / ChunkSize;
+    _vChunks = (vQuads() + ChunkSize - 1) / ChunkSize;
+    _dirtyChunks.assign(_uChunks * _vChunks, 0);
+}
+
+void SurfaceGenerator::addBump(QVector2D uv, float radius, float height)
+{
+    Bump b = { uv, radius, height };
+    _bumps.push_back(b);
+    markBumpDirty(b);
+}
+
+void SurfaceGenerator::clearBumps()
+{
+    for (const auto &b : _bumps)
+        markBumpDirty(b);
+    _bumps.clear();
+}
+
+// Mark every chunk with a quad that has a vertex within the bump's bounding square.
+void SurfaceGenerator::markBumpDirty(const Bump &b)
+{
+    if (_dirtyChunks.empty())
+        return;
+
+    std::vector<char> uMark(_uChunks, 0), vMark(_vChunks, 0);
+    const int uq = uQuads(), vq = vQuads();
+
+    // Vertices u0..u1 touch quads u0-1..u1.
+    const int u0 = (int)ceilf((b.uv.x() - b.radius) * _uSegments) - 1;
+    const int u1 = (int)floorf((b.uv.x() + b.radius) * _uSegments);
+    for (int u = u0; u <= std::min(u1, u0 + uq - 1); ++u) {
+        const int q = _closeU ? ((u % uq) + uq) % uq : std::max(0, std::min(u, uq - 1));
+        uMark[q / ChunkSize] = 1;
+    }
+
+    const int v0 = (int)ceilf((b.uv.y() - b.radius) * _vSegments) - 1;
+    const int v1 = (int)floorf((b.uv.y() + b.radius) * _vSegments);
+    for (int v = v0; v <= std::min(v1, v0 + vq - 1); ++v) {
+        const int q = _closeV ? ((v % vq) + vq) % vq : std::max(0, std::min(v, vq - 1));
+        vMark[q / ChunkSize] = 1;
+    }
+
+    for (int cu = 0; cu < _uChunks; ++cu)
+    for (int cv = 0; cv < _vChunks; ++cv)
+        if (uMark[cu] && vMark[cv])
+            _dirtyChunks[cu * _vChunks + cv] = 1;
+}
+
+bool SurfaceGenerator::hasDirtyChunks() const
+{
+    return std::find(_dirtyChunks.begin(), _dirtyChunks.end(), 1) != _dirtyChunks.end();
+}
+
+// Give the positions and normals a private copy if they are still shared (see shareTriangles()); UVs are only
+// written by generate(), which makes new buffers anyway.
+void SurfaceGenerator::detachOutput()
+{
+    if (_triangles.use_count() > 1)
+        _triangles = std::make_shared<std::vector<QVector3D>>(*_triangles);
+    if (_normals.use_count() > 1)
+        _normals = std::make_shared<std::vector<QVector3D>>(*_normals);
+}
+
+// Recompute positions and flat normals of the dirty chunks; UVs don't depend on the bumps.  Returns the
+// changed vertex ranges, adjacent chunks merged.
+std::vector<SurfaceGenerator::Range> SurfaceGenerator::updateDirtyChunks()
+{
+    std::vector<Range> ranges;
+    std::vector<QVector3D> grid;
+
+    if (hasDirtyChunks())
+        detachOutput();
+
+    for (int cu = 0; cu < _uChunks; ++cu)
+    for (int cv = 0; cv < _vChunks; ++cv)
+    {
+        if (!_dirtyChunks[cu * _vChunks + cv])
+            continue;
+        _dirtyChunks[cu * _vChunks + cv] = 0;
+        updateChunk(cu, cv, grid);
+
+        const int w = std::min(ChunkSize, uQuads() - cu * ChunkSize);
+        const int h = std::min(ChunkSize, vQuads() - cv * ChunkSize);
+        Range r = { 6 * quadIndex(cu * ChunkSize, cv * ChunkSize), 6 * w * h };
+        if (!ranges.empty() && ranges.back().first + ranges.back().count == r.first)
+            ranges.back().count += r.count;
+        else
+            ranges.push_back(r);
+    }
+    return ranges;
+}
+
+// Evaluate the chunk's (w+1) x (h+1) vertices into grid, then rewrite its triangles as halfQuadVertex() and
+// halfQuadFlatNormal() would.
+void SurfaceGenerator::updateChunk(int cu, int cv, std::vector<QVector3D> &grid)
+{
+    const int u0 = cu * ChunkSize, v0 = cv * ChunkSize;
+    const int w = std::min(ChunkSize, uQuads() - u0), h = std::min(ChunkSize, vQuads() - v0);
+
+    std::vector<QVector3D> &triangles = *_triangles, &normals = *_normals;
+
+    grid.resize((w + 1) * (h + 1));
+    for (int u = 0; u <= w; ++u)
+    for (int v = 0; v <= h; ++v)
+        grid[u * (h + 1) + v] = vertex((u0 + u) % _uSegments, (v0 + v) % _vSegments);
+
+    for (int u = 0; u < w; ++u)
+    for (int v = 0; v < h; ++v)
+    {
+        const QVector3D c[4] = {
+            grid[u * (h + 1) + v], grid[(u + 1) * (h + 1) + v],
+            grid[(u + 1) * (h + 1) + v + 1], grid[u * (h + 1) + v + 1]
+        };
+        const int o = 6 * quadIndex(u0 + u, v0 + v);
+
+        for (int t = 0; t < 2; ++t) {
+            const QVector3D n = QVector3D::normal(c[0], c[1+t], c[2+t]);
+            triangles[o + 3*t] = c[0];
+            triangles[o + 3*t + 1] = c[1+t];
+            triangles[o + 3*t + 2] = c[2+t];
+            normals[o + 3*t] = normals[o + 3*t + 1] = normals[o + 3*t + 2] = n;
+        }
+    }
 }
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <memory>
 #include <vector>
 #include <QVector2D>
 #include <QVector3D>
+#include "MemoryStats.h"
 
 class SurfaceGenerator
 {
@@ -11,14 +13,44 @@ class SurfaceGenerator
 
     // Temporary data.
     std::vector<QVector3D> _uvVertex, _uvNormal;
+
+    // Grid kept from the previous generate() when reusing vertices, and how many times F was called.
+    std::vector<QVector3D> _prevVertex;
+    int _prevUSegments, _prevVSegments;
+    bool _reuseVertices;
+    int _evaluations;
     
-    // 3 elements per triangle
-    std::vector<QVector3D> _triangles, _normals;
-    std::vector<QVector2D> _uvs;
+    // 3 elements per triangle, 2 triangles per quad; quads are grouped into ChunkSize x ChunkSize chunks so
+    // that each chunk is one contiguous range (see quadIndex()).  Shared with the holders of share*(), so
+    // rewriting them in place must go through detachOutput().
+    std::shared_ptr<std::vector<QVector3D>> _triangles, _normals;
+    std::shared_ptr<std::vector<QVector2D>> _uvs;
     std::vector<short> _divideCount;
 
+    // Local deformations, in UV units, and the chunks whose output is stale.
+    struct Bump
+    {
+        QVector2D uv;
+        float radius, height;
+    };
+    std::vector<Bump> _bumps;
+    std::vector<char> _dirtyChunks;
+    int _uChunks, _vChunks;
+
+    MemoryCharge _scratchCharge, _outputCharge;
+    void updateMemoryCharges();
+
     int VI(int u, int v) const { return u * _vSegments + v; }
-    
+    int uQuads() const { return _uSegments - 1 + _closeU; }
+    int vQuads() const { return _vSegments - 1 + _closeV; }
+    void quadAt(int quad, int &u, int &v) const;
+
+    QVector3D vertex(int u, int v) const;
+    void resetChunks();
+    void detachOutput();
+    void markBumpDirty(const Bump &b);
+    void updateChunk(int cu, int cv, std::vector<QVector3D> &grid);
+
     void generateUVVertex();
     void generateTrianglesAndUVs();
     void generateSmoothNormals();
@@ -34,18 +66,66 @@ class SurfaceGenerator
     }
 
 protected:
-    int getUSegmentCount() const { return _uSegments; }
-    int getVSegmentCount() const { return _vSegments; }
-
     virtual QVector2D UV(int u, int v) const = 0;
     virtual QVector3D F(QVector2D uv) const = 0;
 
+    // True if UV(u, v) at n segments equals UV(k*u, k*v) at k*n segments, so that coarser grids are subsets
+    // of finer ones.
+    virtual bool isNested() const { return false; }
+
 public:
+    // Chunk side, in quads.
+    static const int ChunkSize = 32;
+
+    // A range of output elements (vertices), as updated by updateDirtyChunks().
+    struct Range
+    {
+        int first, count;
+    };
+
+    SurfaceGenerator() :
+        _uSegments(0), _vSegments(0), _closeU(false), _closeV(false),
+        _prevUSegments(0), _prevVSegments(0), _reuseVertices(false), _evaluations(0),
+        _triangles(std::make_shared<std::vector<QVector3D>>()), _normals(std::make_shared<std::vector<QVector3D>>()),
+        _uvs(std::make_shared<std::vector<QVector2D>>()), _uChunks(0), _vChunks(0),
+        _scratchCharge(MemoryStats::GeneratorScratch), _outputCharge(MemoryStats::GeneratorOutput)
+    { }
+    virtual ~SurfaceGenerator() { }
+
+    int getUSegmentCount() const { return _uSegments; }
+    int getVSegmentCount() const { return _vSegments; }
+
+    // Progressive refinement: keep each evaluated grid so that a following generate() at a multiple of its
+    // resolution takes the coinciding vertices from it instead of calling F.  Only effective if isNested().
+    void setReuseVertices(bool reuse);
+    int getEvaluationCount() const { return _evaluations; }
+
+    // Take over other's generated output (not its reuse grid); other is left empty.
+    void adoptOutput(SurfaceGenerator &other);
+
+    static qint64 estimateBytes(int uSegments, int vSegments);
     void generate(int uSegments, int vSegments, bool closeU, bool closeV);
     int uvIndex(int u, int v) { return VI(u, v); }
-    const std::vector<QVector3D> &getTriangles() const { return _triangles; }
-    const std::vector<QVector3D> &getNormals() const { return _normals; }
-    const std::vector<QVector2D> &getUVs() const { return _uvs; }
+    int quadIndex(int u, int v) const;
+    QVector2D triangleUV(int triangle, float b1, float b2) const;
+    const std::vector<QVector3D> &getTriangles() const { return *_triangles; }
+    const std::vector<QVector3D> &getNormals() const { return *_normals; }
+    const std::vector<QVector2D> &getUVs() const { return *_uvs; }
+
+    // The output without a copy, e.g. for an upload on another thread.  It stays as it is now: a later
+    // updateDirtyChunks() copies a buffer that is still shared before changing it.
+    std::shared_ptr<const std::vector<QVector3D>> shareTriangles() const { return _triangles; }
+    std::shared_ptr<const std::vector<QVector3D>> shareNormals() const { return _normals; }
+    std::shared_ptr<const std::vector<QVector2D>> shareUVs() const { return _uvs; }
+
+    // Bumps displace the surface along its normal by height * (1 - d^2)^2 within radius (both in UV units).
+    // They persist across generate(); changing them only marks the chunks they touch as dirty, and
+    // updateDirtyChunks() recomputes positions and (flat) normals of just those chunks.
+    void addBump(QVector2D uv, float radius, float height);
+    void clearBumps();
+    bool hasBumps() const { return !_bumps.empty(); }
+    bool hasDirtyChunks() const;
+    std::vector<Range> updateDirtyChunks();
 };
 
 // TODO! Move geometry generation into the vertex shader!
@@ -59,6 +139,8 @@ protected:
         return QVector2D(uu, vv);
     }
 
+    virtual bool isNested() const override { return true; }
+
     virtual QVector3D F(QVector2D uv) const override
     {
         static const float pi = 3.1416f;
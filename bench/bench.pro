@@ -0,0 +1,9 @@
+# Offscreen GL submission and render mode benchmarks.  Run from the repository root so that Shaders/ is found.
+TARGET        = drawbench
+CONFIG       += console
+CONFIG       -= app_bundle
+QT           += gui
+INCLUDEPATH  += ..
+HEADERS       = ../DrawBenchmark.h ../SceneBenchmark.h ../SceneRenderer.h ../SurfaceGenerator.h ../MemoryStats.h
+SOURCES       = main.cpp ../DrawBenchmark.cpp ../SceneBenchmark.cpp ../SceneRenderer.cpp ../SurfaceGenerator.cpp \
+                ../MemoryStats.cpp
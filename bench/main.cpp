@@ -0,0 +1,92 @@
+// Headless driver for DrawBenchmark and SceneBenchmark: no window, just an offscreen surface and a 3.3 core
+// context.  Prints the results tables and the memory the benchmarks allocated.
+
+#include <stdio.h>
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QSurfaceFormat>
+#include "DrawBenchmark.h"
+#include "SceneBenchmark.h"
+#include "MemoryStats.h"
+
+int main(int argc, char *argv[])
+{
+    QGuiApplication app(argc, argv);
+    DrawBenchmark::Config config;
+    SceneBenchmark::Config sceneConfig;
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("GL draw submission and render mode benchmarks");
+    parser.addHelpOption();
+    QCommandLineOption objects("objects", "Objects per frame.", "n", QString::number(config.objectCount));
+    QCommandLineOption triangles("triangles", "Triangles per object.", "n",
+        QString::number(config.trianglesPerObject));
+    QCommandLineOption frames("frames", "Measured frames per path.", "n", QString::number(config.frames));
+    parser.addOption(objects);
+    parser.addOption(triangles);
+    QCommandLineOption segments("segments", "Surface segments for the render modes.", "n",
+        QString::number(sceneConfig.segmentCount));
+    QCommandLineOption instances("instances", "Surfaces in the render mode scene.", "n",
+        QString::number(sceneConfig.instanceCount));
+    parser.addOption(frames);
+    parser.addOption(segments);
+    parser.addOption(instances);
+    parser.process(app);
+
+    config.objectCount = qMax(1, parser.value(objects).toInt());
+    config.trianglesPerObject = qMax(1, parser.value(triangles).toInt());
+    config.frames = qMax(1, parser.value(frames).toInt());
+    sceneConfig.segmentCount = qMax(2, parser.value(segments).toInt());
+    sceneConfig.instanceCount = qMax(1, parser.value(instances).toInt());
+    sceneConfig.frames = config.frames;
+
+    QSurfaceFormat fmt;
+    fmt.setVersion(3, 3);
+    fmt.setProfile(QSurfaceFormat::CoreProfile);
+    fmt.setSwapInterval(0);
+
+    QOffscreenSurface surface;
+    surface.setFormat(fmt);
+    surface.create();
+
+    QOpenGLContext context;
+    context.setFormat(fmt);
+    if (!context.create() || !context.makeCurrent(&surface)) {
+        fprintf(stderr, "cannot create a 3.3 core context\n");
+        return 1;
+    }
+
+    QOpenGLFunctions_3_3_Core *G = context.versionFunctions<QOpenGLFunctions_3_3_Core>();
+    if (!G || !G->initializeOpenGLFunctions()) {
+        fprintf(stderr, "3.3 core functions unavailable\n");
+        return 1;
+    }
+
+    int status = 0;
+    {
+        DrawBenchmark benchmark(G);
+        QString log;
+        if (benchmark.initialize(config, log)) {
+            printf("%s", qPrintable(DrawBenchmark::table(config, benchmark.runAll())));
+        } else {
+            fprintf(stderr, "%s", qPrintable(log));
+            status = 1;
+        }
+    }
+    {
+        SceneBenchmark benchmark(G);
+        QString log;
+        if (benchmark.initialize(sceneConfig, log)) {
+            printf("\n%s", qPrintable(SceneBenchmark::table(sceneConfig, benchmark.runAll())));
+        } else {
+            fprintf(stderr, "%s", qPrintable(log));
+            status = 1;
+        }
+    }
+    printf("\n%s\n", qPrintable(MemoryStats::report()));
+
+    context.doneCurrent();
+    return status;
+}
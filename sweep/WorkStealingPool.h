@@ -0,0 +1,212 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads, one task deque each.  A worker pops its own deque LIFO and steals FIFO from the
+// others when it runs dry.  Tasks may submit and wait for subtasks: a worker in wait() runs queued tasks of the
+// group it waits for instead of blocking, so nested parallelism shares the same threads.  Only the workers run
+// tasks; an outside thread in wait() just blocks, so at most threadCount() tasks run at once.
+class WorkStealingPool
+{
+public:
+    // Tasks whose completion can be waited for together.
+    class Group
+    {
+        friend class WorkStealingPool;
+        std::atomic<int> _pending;      // submitted, not finished
+        std::atomic<int> _queued;       // submitted, not started
+    public:
+        Group() : _pending(0), _queued(0) { }
+    };
+
+    explicit WorkStealingPool(int threadCount = 0);     // 0: one per hardware thread
+    ~WorkStealingPool();
+
+    int threadCount() const { return (int)_threads.size(); }
+    void submit(Group &group, std::function<void()> task);
+    void wait(Group &group);
+
+private:
+    struct Task
+    {
+        std::function<void()> run;
+        Group *group;
+    };
+
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    int currentWorker() const;
+    bool tryRunOne(int self, Group *only = 0);
+    void workerLoop(int index);
+
+    std::vector<std::unique_ptr<Worker>> _workers;
+    std::vector<std::thread> _threads;
+    std::vector<std::thread::id> _threadIds;
+
+    std::mutex _idleMutex;
+    std::condition_variable _idle;
+    std::atomic<int> _queued;
+    std::atomic<unsigned> _nextWorker;
+    bool _stopping;
+};
+
+inline WorkStealingPool::WorkStealingPool(int threadCount) : _queued(0), _nextWorker(0), _stopping(false)
+{
+    if (threadCount <= 0)
+        threadCount = (int)std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i = 0; i < threadCount; ++i)
+        _workers.push_back(std::unique_ptr<Worker>(new Worker));
+
+    // Ids are filled in before any worker can look itself up.
+    std::lock_guard<std::mutex> lock(_idleMutex);
+    for (int i = 0; i < threadCount; ++i) {
+        _threads.push_back(std::thread(&WorkStealingPool::workerLoop, this, i));
+        _threadIds.push_back(_threads.back().get_id());
+    }
+}
+
+inline WorkStealingPool::~WorkStealingPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_idleMutex);
+        _stopping = true;
+    }
+    _idle.notify_all();
+    for (auto &t : _threads)
+        t.join();
+}
+
+// Index of the calling worker, or -1 for outside threads.
+inline int WorkStealingPool::currentWorker() const
+{
+    const std::thread::id id = std::this_thread::get_id();
+    for (size_t i = 0; i < _threadIds.size(); ++i)
+        if (_threadIds[i] == id)
+            return (int)i;
+    return -1;
+}
+
+// Workers push onto their own deque so that nested work stays local; outside threads spread round-robin.
+inline void WorkStealingPool::submit(Group &group, std::function<void()> task)
+{
+    int w = currentWorker();
+    if (w < 0)
+        w = (int)(_nextWorker++ % _workers.size());
+
+    ++group._pending;
+    ++group._queued;
+    {
+        std::lock_guard<std::mutex> lock(_workers[w]->mutex);
+        Task t;
+        t.run = std::move(task);
+        t.group = &group;
+        _workers[w]->tasks.push_back(std::move(t));
+    }
+    {
+        std::lock_guard<std::mutex> lock(_idleMutex);
+        ++_queued;
+    }
+    _idle.notify_all();     // idle workers and workers waiting for this group
+}
+
+// Run one queued task, if only is given one of that group.  Own deque from the back, others from the front.
+inline bool WorkStealingPool::tryRunOne(int self, Group *only)
+{
+    const int n = (int)_workers.size();
+    const int start = self >= 0 ? self : (int)(_nextWorker % n);
+    Task task;
+    bool found = false;
+
+    for (int k = 0; k < n && !found; ++k)
+    {
+        const int w = (start + k) % n;
+        std::lock_guard<std::mutex> lock(_workers[w]->mutex);
+        std::deque<Task> &q = _workers[w]->tasks;
+        if (q.empty())
+            continue;
+
+        if (!only) {
+            if (w == self) {
+                task = std::move(q.back());
+                q.pop_back();
+            } else {
+                task = std::move(q.front());
+                q.pop_front();
+            }
+            found = true;
+        } else {
+            // Nearest to where the unfiltered pop would take from.
+            const int size = (int)q.size();
+            for (int i = 0; i < size; ++i) {
+                const int j = w == self ? size - 1 - i : i;
+                if (q[j].group == only) {
+                    task = std::move(q[j]);
+                    q.erase(q.begin() + j);
+                    found = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (!found)
+        return false;
+
+    --_queued;
+    --task.group->_queued;
+    task.run();
+    if (--task.group->_pending == 0) {
+        std::lock_guard<std::mutex> lock(_idleMutex);
+        _idle.notify_all();
+    }
+    return true;
+}
+
+// A worker helps with the group's own tasks only: running unrelated ones here would delay the caller, which
+// may be timing the wait, by however long those take.  Outside threads don't run tasks at all.
+inline void WorkStealingPool::wait(Group &group)
+{
+    const int self = currentWorker();
+
+    while (group._pending > 0)
+    {
+        if (self >= 0 && tryRunOne(self, &group))
+            continue;
+        // Nothing to help with; the remaining tasks are running elsewhere.
+        std::unique_lock<std::mutex> lock(_idleMutex);
+        _idle.wait_for(lock, std::chrono::milliseconds(1), [&]() {
+            return group._pending == 0 || (self >= 0 && group._queued > 0);
+        });
+    }
+}
+
+inline void WorkStealingPool::workerLoop(int index)
+{
+    {
+        std::lock_guard<std::mutex> lock(_idleMutex);    // wait for _threadIds
+    }
+
+    for (;;)
+    {
+        if (tryRunOne(index))
+            continue;
+        std::unique_lock<std::mutex> lock(_idleMutex);
+        if (_stopping)
+            return;
+        _idle.wait(lock, [&]() { return _stopping || _queued > 0; });
+    }
+}
@@ -0,0 +1,180 @@
+// Batch generation of surface variants without the GUI.  The sweep is the cartesian product of the given
+// segment counts and open/closed U/V settings; every variant is one job on a work-stealing pool.  Jobs split
+// their own output writing into subtasks on the same pool, so the machine is never oversubscribed.
+//
+//   surfacesweep --segments 64,128,256 --close-u 0,1 --close-v 1 --out sweep_out
+//
+// Each job writes <out>/surface_<segments>_u<closeU>_v<closeV>.surf:
+//   char magic[4] = "SURF"; int32 version, uSegments, vSegments, closeU, closeV, vertexCount;
+//   then vertexCount positions (3 floats), normals (3 floats) and UVs (2 floats), in SurfaceGenerator order.
+// Version 1 had the quads row by row; version 2 has them in SurfaceGenerator::ChunkSize chunks (quadIndex()).
+
+#include <stdio.h>
+#include <algorithm>
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include "WorkStealingPool.h"
+#include "SurfaceGenerator.h"
+#include "MemoryStats.h"
+
+static const qint32 SurfFormatVersion = 2;
+
+struct Job
+{
+    int segments;
+    bool closeU, closeV;
+
+    QString path;
+    bool ok;
+    qint64 vertexCount, bytes;
+    double generateMs, writeMs;
+};
+
+static QList<int> parseList(const QString &s)
+{
+    QList<int> values;
+    for (const QString &v : s.split(',', QString::SkipEmptyParts))
+        values.append(v.trimmed().toInt());
+    return values;
+}
+
+// Write one section of an already sized file through its own handle, so that sections can go in parallel.
+static bool writeSection(const QString &path, qint64 offset, const void *data, qint64 size)
+{
+    QFile f(path);
+    return f.open(QIODevice::ReadWrite) && f.seek(offset) && f.write((const char*)data, size) == size;
+}
+
+static void runJob(WorkStealingPool &pool, Job &job)
+{
+    QElapsedTimer timer;
+    ProjectiveGenerator generator;
+
+    timer.start();
+    generator.generate(job.segments, job.segments, job.closeU, job.closeV);
+    job.generateMs = timer.nsecsElapsed() / 1e6;
+
+    const auto &triangles = generator.getTriangles();
+    const auto &normals = generator.getNormals();
+    const auto &uvs = generator.getUVs();
+    const qint32 header[6] = {
+        SurfFormatVersion, job.segments, job.segments, job.closeU, job.closeV, (qint32)triangles.size()
+    };
+    const qint64 headerSize = 4 + sizeof(header);
+    const qint64 positionsSize = triangles.size() * sizeof(QVector3D);
+    const qint64 normalsSize = normals.size() * sizeof(QVector3D);
+    const qint64 uvsSize = uvs.size() * sizeof(QVector2D);
+
+    job.vertexCount = triangles.size();
+    job.bytes = headerSize + positionsSize + normalsSize + uvsSize;
+
+    timer.restart();
+    {
+        QFile f(job.path);
+        job.ok = f.open(QIODevice::WriteOnly | QIODevice::Truncate)
+            && f.write("SURF", 4) == 4
+            && f.write((const char*)header, sizeof(header)) == sizeof(header)
+            && f.resize(job.bytes);
+    }
+
+    if (job.ok) {
+        std::atomic<bool> ok(true);
+        WorkStealingPool::Group sections;
+        pool.submit(sections, [&]() {
+            if (!writeSection(job.path, headerSize, &triangles[0], positionsSize)) ok = false;
+        });
+        pool.submit(sections, [&]() {
+            if (!writeSection(job.path, headerSize + positionsSize, &normals[0], normalsSize)) ok = false;
+        });
+        pool.submit(sections, [&]() {
+            if (!writeSection(job.path, headerSize + positionsSize + normalsSize, &uvs[0], uvsSize)) ok = false;
+        });
+        pool.wait(sections);
+        job.ok = ok;
+    }
+    job.writeMs = timer.nsecsElapsed() / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Generate surface variants in parallel");
+    parser.addHelpOption();
+    QCommandLineOption segments("segments", "Comma-separated segment counts.", "list", "64,128,256");
+    QCommandLineOption closeU("close-u", "Comma-separated 0/1 values for closing U.", "list", "1");
+    QCommandLineOption closeV("close-v", "Comma-separated 0/1 values for closing V.", "list", "1");
+    QCommandLineOption out("out", "Output directory.", "dir", "sweep_out");
+    QCommandLineOption threads("threads", "Worker threads; 0 for one per hardware thread.", "n", "0");
+    parser.addOption(segments);
+    parser.addOption(closeU);
+    parser.addOption(closeV);
+    parser.addOption(out);
+    parser.addOption(threads);
+    parser.process(app);
+
+    const QString outDir = parser.value(out);
+    if (!QDir().mkpath(outDir)) {
+        fprintf(stderr, "cannot create %s\n", qPrintable(outDir));
+        return 1;
+    }
+
+    std::vector<Job> jobs;
+    for (int s : parseList(parser.value(segments)))
+    for (int cu : parseList(parser.value(closeU)))
+    for (int cv : parseList(parser.value(closeV)))
+    {
+        if (s < 2)
+            continue;
+        Job job;
+        job.segments = s;
+        job.closeU = cu != 0;
+        job.closeV = cv != 0;
+        job.path = QString("%1/surface_%2_u%3_v%4.surf").arg(outDir).arg(s).arg(cu != 0).arg(cv != 0);
+        job.ok = false;
+        job.vertexCount = job.bytes = 0;
+        job.generateMs = job.writeMs = 0;
+        jobs.push_back(job);
+    }
+
+    // Biggest first, so that a large job started last doesn't leave the other workers idle at the end.
+    std::sort(jobs.begin(), jobs.end(), [](const Job &a, const Job &b) { return a.segments > b.segments; });
+
+    WorkStealingPool pool(parser.value(threads).toInt());
+    WorkStealingPool::Group all;
+    QElapsedTimer wall;
+
+    wall.start();
+    for (auto &job : jobs)
+        pool.submit(all, [&pool, &job]() { runJob(pool, job); });
+    pool.wait(all);
+    const double wallMs = wall.nsecsElapsed() / 1e6;
+
+    qint64 totalTriangles = 0, totalBytes = 0;
+    double busyMs = 0;
+    int failed = 0;
+
+    printf("%-40s %10s %10s %10s %12s\n", "job", "triangles", "gen ms", "write ms", "Mtri/s");
+    for (const auto &job : jobs) {
+        const qint64 tris = job.vertexCount / 3;
+        const double ms = job.generateMs + job.writeMs;
+        printf("%-40s %10lld %10.1f %10.1f %12.2f%s\n", qPrintable(QFileInfo(job.path).fileName()), tris,
+            job.generateMs, job.writeMs, ms > 0 ? tris / ms / 1e3 : 0.0, job.ok ? "" : "  WRITE FAILED");
+        totalTriangles += tris;
+        totalBytes += job.bytes;
+        busyMs += ms;
+        failed += !job.ok;
+    }
+
+    printf("\n%d jobs on %d threads: %.1f ms wall, %.2f Mtri/s, %.1f MB/s, %.2fx over serial job time\n",
+        (int)jobs.size(), pool.threadCount(), wallMs, totalTriangles / wallMs / 1e3,
+        totalBytes / (1024.0 * 1024.0) / (wallMs / 1e3), wallMs > 0 ? busyMs / wallMs : 0.0);
+    printf("\n%s\n", qPrintable(MemoryStats::report()));
+
+    return failed ? 1 : 0;
+}
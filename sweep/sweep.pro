@@ -0,0 +1,8 @@
+# Headless batch generation of surface variants; see main.cpp for the sweep options.
+TARGET        = surfacesweep
+CONFIG       += console c++11
+CONFIG       -= app_bundle
+QT           += gui
+INCLUDEPATH  += ..
+HEADERS       = WorkStealingPool.h ../SurfaceGenerator.h ../MemoryStats.h
+SOURCES       = main.cpp ../SurfaceGenerator.cpp ../MemoryStats.cpp
@@ -7,6 +7,9 @@
 #include <QApplication>
 #include <QFormLayout>
 #include <QValidator>
+#include <QSignalBlocker>
+#include <QTimer>
+#include "MemoryStats.h"
 #include "window.h"
 
 Window::Window(QWidget *parent) : QWidget(parent)
@@ -21,14 +24,90 @@ Window::Window(QWidget *parent) : QWidget(parent)
     _vSlider = createSlider(0, _segmentCount);
     connect(_vSlider, SIGNAL(valueChanged(int)), _projectiveWidget, SLOT(setCameraV(int)));
 
+    connect(_projectiveWidget, &ProjectiveWidget::cameraSurfacePositionChanged, this, &Window::showCameraPosition);
+    connect(_projectiveWidget, &ProjectiveWidget::surfacePicked, this, &Window::showSurfacePick);
+
     _hSlider = createSlider(0, 32);
     connect(_hSlider, SIGNAL(valueChanged(int)), _projectiveWidget, SLOT(setCameraHeight(int)));
 
     _fov = new QLineEdit("1");
     _fov->setValidator(new QDoubleValidator(0.1, 10, 2));
 
-    _segments = new QLineEdit("128");
-    _segments->setValidator(new QIntValidator(16, 512));
+    // Dragging only records the latest value; the widget regenerates at most once per frame.  A count over the
+    // memory budget is refused, and the slider goes back to the current one.
+    _segments = createSlider(16, 512);
+    _segments->setValue(_segmentCount);
+    connect(_segments, &QSlider::valueChanged, [this](int count) {
+        if (!_projectiveWidget->setSegmentCount(count)) {
+            QSignalBlocker blocker(_segments);
+            _segments->setValue(_segmentCount);
+            return;
+        }
+        _segmentCount = count;
+        _uSlider->setMaximum(count - 1);
+        _vSlider->setMaximum(count - 1);
+    });
+
+    // Number of surfaces in the scene, all drawn with a single instanced call.
+    _instances = new QSpinBox;
+    _instances->setRange(1, 16384);
+    connect(_instances, static_cast<void (QSpinBox::*)(int)>(&QSpinBox::valueChanged),
+        _projectiveWidget, &ProjectiveWidget::setInstanceCount);
+
+    // Show a coarse level at once and refine in the background, reusing already evaluated vertices.
+    _progressive = new QCheckBox("Progressive refinement");
+    connect(_progressive, &QCheckBox::toggled, _projectiveWidget, &ProjectiveWidget::setProgressive);
+
+    _meshInfo = new QLabel;
+    connect(_projectiveWidget, &ProjectiveWidget::meshReady, [this](int segmentCount, int evaluations) {
+        _meshInfo->setText(QString("%1 segments, %2 new F evaluations").arg(segmentCount).arg(evaluations));
+    });
+
+    // A bump that follows the camera; only the chunks it touches are recomputed and re-uploaded.
+    _deformCamera = new QCheckBox("Deform around camera");
+    connect(_deformCamera, &QCheckBox::toggled, _projectiveWidget, &ProjectiveWidget::setDeformCamera);
+
+    _chunkInfo = new QLabel;
+    connect(_projectiveWidget, &ProjectiveWidget::chunksUpdated,
+        [this](int vertexCount, qint64 bytes, float milliseconds) {
+        _chunkInfo->setText(QString("%1 vertices, %2 KB, %3 ms")
+            .arg(vertexCount).arg(bytes / 1024.0, 0, 'f', 1).arg(milliseconds, 0, 'f', 2));
+    });
+
+    // Order matches ProjectiveWidget::RenderMode.
+    _renderMode = new QComboBox;
+    _renderMode->addItems(QStringList() << "Blend, no depth" << "Opaque" << "Opaque, depth pre-pass"
+        << "Weighted blended OIT");
+    _renderMode->setCurrentIndex(ProjectiveWidget::OpaqueMode);
+    connect(_renderMode, static_cast<void (QComboBox::*)(int)>(&QComboBox::currentIndexChanged),
+        _projectiveWidget, &ProjectiveWidget::setRenderMode);
+
+    _frameInfo = new QLabel;
+    connect(_projectiveWidget, &ProjectiveWidget::frameStats, [this](float gpuMilliseconds, float overdraw) {
+        _frameInfo->setText(QString("%1 ms GPU, overdraw %2x")
+            .arg(gpuMilliseconds, 0, 'f', 2).arg(overdraw, 0, 'f', 2));
+    });
+
+    // Render at a fraction of the widget's resolution, adjusted from GPU frame times to hold the target.
+    _dynamicResolution = new QCheckBox("Dynamic resolution");
+    connect(_dynamicResolution, &QCheckBox::toggled, _projectiveWidget, &ProjectiveWidget::setDynamicResolution);
+    connect(_dynamicResolution, &QCheckBox::toggled, [this](bool enabled) {
+        if (!enabled)
+            _resolutionInfo->setText("full");
+    });
+
+    _targetFrameTime = new QLineEdit("16.6");
+    _targetFrameTime->setValidator(new QDoubleValidator(1, 1000, 1));
+    connect(_targetFrameTime, &QLineEdit::editingFinished, [this]() {
+        _projectiveWidget->setTargetFrameTime(_targetFrameTime->text().toDouble());
+    });
+
+    _resolutionInfo = new QLabel("full");
+    connect(_projectiveWidget, &ProjectiveWidget::resolutionStats,
+        [this](float scale, int width, int height, float averageMilliseconds) {
+        _resolutionInfo->setText(QString("%1x (%2x%3), %4 ms avg")
+            .arg(scale, 0, 'f', 3).arg(width).arg(height).arg(averageMilliseconds, 0, 'f', 2));
+    });
 
     QFormLayout *formLayout = new QFormLayout;
     formLayout->addRow("U position", _uSlider);
@@ -36,6 +115,41 @@ Window::Window(QWidget *parent) : QWidget(parent)
     formLayout->addRow("H position", _hSlider);
     formLayout->addRow("FOV", _fov);
     formLayout->addRow("Segments", _segments);
+    formLayout->addRow(_progressive);
+    formLayout->addRow("Mesh", _meshInfo);
+    formLayout->addRow(_deformCamera);
+    formLayout->addRow("Chunk update", _chunkInfo);
+    formLayout->addRow("Instances", _instances);
+    formLayout->addRow("Render mode", _renderMode);
+    formLayout->addRow("Frame", _frameInfo);
+    formLayout->addRow(_dynamicResolution);
+    formLayout->addRow("Target frame (ms)", _targetFrameTime);
+    formLayout->addRow("Resolution", _resolutionInfo);
+
+    _pickInfo = new QLabel("(hover over the surface)");
+    formLayout->addRow("Pick", _pickInfo);
+
+    // Segment counts whose estimated footprint exceeds the budget are refused before generating.
+    _memoryBudget = new QLineEdit("1024");
+    _memoryBudget->setValidator(new QIntValidator(0, 1 << 20));
+    MemoryStats::setBudget(1024LL << 20);
+    connect(_memoryBudget, &QLineEdit::editingFinished, [this]() {
+        MemoryStats::setBudget(_memoryBudget->text().toLongLong() << 20);
+        _memoryWarning->clear();
+    });
+    formLayout->addRow("Memory budget (MB)", _memoryBudget);
+
+    _memoryWarning = new QLabel;
+    _memoryWarning->setStyleSheet("color: red");
+    _memoryWarning->setWordWrap(true);
+    connect(_projectiveWidget, &ProjectiveWidget::memoryBudgetExceeded, _memoryWarning, &QLabel::setText);
+    formLayout->addRow(_memoryWarning);
+
+    _memoryInfo = new QLabel;
+    formLayout->addRow("Memory", _memoryInfo);
+    QTimer *memoryTimer = new QTimer(this);
+    connect(memoryTimer, &QTimer::timeout, [this]() { _memoryInfo->setText(MemoryStats::report()); });
+    memoryTimer->start(500);
 
 
     _compileButton = new QPushButton("Compile shaders");
@@ -68,6 +182,22 @@ QSlider *Window::createSlider(int low, int high)
     return slider;
 }
 
+void Window::showSurfacePick(const QVector2D uv, const QVector3D position, const QVector3D normal)
+{
+    _pickInfo->setText(QString("uv (%1, %2)\npos (%3, %4, %5)\nnormal (%6, %7, %8)")
+        .arg(uv.x(), 0, 'f', 2).arg(uv.y(), 0, 'f', 2)
+        .arg(position.x(), 0, 'f', 3).arg(position.y(), 0, 'f', 3).arg(position.z(), 0, 'f', 3)
+        .arg(normal.x(), 0, 'f', 3).arg(normal.y(), 0, 'f', 3).arg(normal.z(), 0, 'f', 3));
+}
+
+// Keep the sliders in sync when the camera is moved from the surface widget.
+void Window::showCameraPosition(const QVector3D position)
+{
+    QSignalBlocker ub(_uSlider), vb(_vSlider);
+    _uSlider->setValue((int)position.x());
+    _vSlider->setValue((int)position.y());
+}
+
 void Window::keyPressEvent(QKeyEvent *e)
 {
     if (e->key() == Qt::Key_Escape)
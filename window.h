@@ -5,6 +5,10 @@
 #include <QPushButton>
 #include <QLineEdit>
 #include <QTextEdit>
+#include <QLabel>
+#include <QSpinBox>
+#include <QComboBox>
+#include <QCheckBox>
 #include "ProjectiveWidget.h"
 
 class ProjectiveWidget;
@@ -19,12 +23,20 @@ public:
 protected:
     void keyPressEvent(QKeyEvent *event) Q_DECL_OVERRIDE;
 
+private slots:
+    void showSurfacePick(const QVector2D uv, const QVector3D position, const QVector3D normal);
+    void showCameraPosition(const QVector3D position);
+
 private:
     ProjectiveWidget *_projectiveWidget;
-    QSlider *_uSlider, *_vSlider, *_hSlider;
-    QLineEdit *_fov, *_segments;
+    QSlider *_uSlider, *_vSlider, *_hSlider, *_segments;
+    QLineEdit *_fov, *_memoryBudget, *_targetFrameTime;
+    QSpinBox *_instances;
+    QComboBox *_renderMode;
+    QCheckBox *_progressive, *_dynamicResolution, *_deformCamera;
     QPushButton *_compileButton;
     QTextEdit *_compileLog;
+    QLabel *_pickInfo, *_memoryInfo, *_memoryWarning, *_frameInfo, *_meshInfo, *_resolutionInfo, *_chunkInfo;
 
     int _segmentCount;
 